@@ -0,0 +1,278 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <esp_heap_caps.h>
+
+#include "uaio.h"
+#include "waitqueue.h"
+
+
+#define CHUNK_ALIGN 8
+#define CHUNK_SIZE(s) (((s) + (CHUNK_ALIGN - 1)) & ~(CHUNK_ALIGN - 1))
+#define CLASS_CONTAINS(c, p) \
+    (((char *)(p) >= (c)->slab) && \
+     ((char *)(p) < ((c)->slab + ((c)->size * (c)->count))))
+
+
+/* Free chunks are linked through their first word */
+struct chunk {
+    struct chunk *next;
+};
+
+
+static struct uaio_bufpoolclass *
+_class_bysize(struct uaio_bufpool *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i < p->classescount; i++) {
+        if (p->classes[i].size >= size) {
+            return &p->classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static struct uaio_bufpoolclass *
+_class_bychunk(struct uaio_bufpool *p, void *ptr) {
+    size_t i;
+
+    for (i = 0; i < p->classescount; i++) {
+        if (CLASS_CONTAINS(&p->classes[i], ptr)) {
+            return &p->classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+int
+uaio_bufpool_init(struct uaio_bufpool *p, const size_t *sizes,
+        const size_t *counts, size_t classes, uint32_t caps) {
+    struct uaio_bufpoolclass *c;
+    struct chunk *chunk;
+    size_t i;
+    size_t j;
+
+    if ((p == NULL) || (sizes == NULL) || (counts == NULL) ||
+            (classes < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Classes must be sorted to find the best fit in a single pass */
+    for (i = 1; i < classes; i++) {
+        if (sizes[i] <= sizes[i - 1]) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    memset(p, 0, sizeof(struct uaio_bufpool));
+    p->caps = caps;
+    p->classes = uaio_calloc(UAIO_MEM_BUFFER, classes,
+            sizeof(struct uaio_bufpoolclass));
+    if (p->classes == NULL) {
+        return -1;
+    }
+    p->classescount = classes;
+
+    for (i = 0; i < classes; i++) {
+        c = &p->classes[i];
+        c->size = CHUNK_SIZE(sizes[i]);
+        if (c->size < sizeof(struct chunk)) {
+            c->size = CHUNK_SIZE(sizeof(struct chunk));
+        }
+        c->count = counts[i];
+        if (c->count == 0) {
+            continue;
+        }
+
+        if (caps) {
+            c->slab = heap_caps_malloc(c->size * c->count, caps);
+        }
+        else {
+            c->slab = uaio_malloc(UAIO_MEM_BUFFER, c->size * c->count);
+        }
+
+        if (c->slab == NULL) {
+            goto failure;
+        }
+
+        for (j = c->count; j > 0; j--) {
+            chunk = (struct chunk *)(c->slab + c->size * (j - 1));
+            chunk->next = c->freelist;
+            c->freelist = chunk;
+        }
+        c->available = c->count;
+    }
+
+    return 0;
+
+failure:
+    uaio_bufpool_deinit(p);
+    return -1;
+}
+
+
+int
+uaio_bufpool_deinit(struct uaio_bufpool *p) {
+    size_t i;
+    struct uaio_bufpoolclass *c;
+
+    if ((p == NULL) || (p->classes == NULL)) {
+        return -1;
+    }
+
+    for (i = 0; i < p->classescount; i++) {
+        c = &p->classes[i];
+        if (c->slab == NULL) {
+            continue;
+        }
+
+        if (p->caps) {
+            heap_caps_free(c->slab);
+        }
+        else {
+            uaio_free(UAIO_MEM_BUFFER, c->slab);
+        }
+    }
+
+    uaio_free(UAIO_MEM_BUFFER, p->classes);
+    p->classes = NULL;
+    p->classescount = 0;
+    return 0;
+}
+
+
+/* Returns NULL and sets errno to EAGAIN when the matching class is
+ * exhausted, or ENOBUFS when no class is large enough. */
+void *
+uaio_bufpool_get(struct uaio_bufpool *p, size_t size) {
+    struct uaio_bufpoolclass *c = _class_bysize(p, size);
+    struct chunk *chunk;
+
+    if (c == NULL) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    /* The free chunks may be held for the woken waiters */
+    chunk = c->freelist;
+    if ((chunk == NULL) || (c->available <= c->held)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    c->freelist = chunk->next;
+    c->available--;
+    return chunk;
+}
+
+
+/* Holds a free chunk for the first waiter */
+static void
+_hold(struct uaio_bufpoolclass *c) {
+    struct uaio_task *task = uaio_waitqueue_pop(&c->waiters);
+
+    if (task == NULL) {
+        return;
+    }
+
+    task->bufheld = c;
+    c->held++;
+    if (task->status == UAIO_WAITING) {
+        task->status = UAIO_RUNNING;
+    }
+}
+
+
+/* Like uaio_bufpool_get, but takes the chunk held for the task if any */
+void *
+uaio_bufpool_claim(struct uaio_task *task, struct uaio_bufpool *p,
+        size_t size) {
+    struct uaio_bufpoolclass *c = task->bufheld;
+    struct chunk *chunk;
+
+    if (c == NULL) {
+        return uaio_bufpool_get(p, size);
+    }
+
+    task->bufheld = NULL;
+    c->held--;
+    chunk = c->freelist;
+    c->freelist = chunk->next;
+    c->available--;
+    return chunk;
+}
+
+
+/* Passes the chunk held for a task that is gone on to the next waiter */
+void
+uaio_bufpool_unhold(struct uaio_task *task) {
+    struct uaio_bufpoolclass *c = task->bufheld;
+
+    task->bufheld = NULL;
+    c->held--;
+    _hold(c);
+}
+
+
+int
+uaio_bufpool_put(struct uaio_bufpool *p, void *ptr) {
+    struct uaio_bufpoolclass *c;
+    struct chunk *chunk = ptr;
+
+    if ((p == NULL) || (ptr == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c = _class_bychunk(p, ptr);
+    if (c == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    chunk->next = c->freelist;
+    c->freelist = chunk;
+    c->available++;
+    _hold(c);
+    return 0;
+}
+
+
+int
+uaio_bufpool_wait(struct uaio_task *task, struct uaio_bufpool *p,
+        size_t size) {
+    struct uaio_bufpoolclass *c = _class_bysize(p, size);
+
+    if (c == NULL) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    uaio_waitqueue_push(&c->waiters, task);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stddef.h>
+
+#include "uaio.h"
+#include "waitqueue.h"
+
+
+static void
+_broadcast(struct uaio_event *e) {
+    while (e->waiters.head) {
+        uaio_waitqueue_wakeup(&e->waiters);
+    }
+}
+
+
+void
+uaio_event_init(struct uaio_event *e, bool set) {
+    e->set = set;
+    e->waiters.head = NULL;
+    e->waiters.tail = NULL;
+    e->waiters.count = 0;
+}
+
+
+void
+uaio_event_set(struct uaio_event *e) {
+    e->set = true;
+    _broadcast(e);
+}
+
+
+void
+uaio_event_clear(struct uaio_event *e) {
+    e->set = false;
+}
+
+
+/* Wakes up the current waiters but leaves the event cleared */
+void
+uaio_event_pulse(struct uaio_event *e) {
+    e->set = false;
+    _broadcast(e);
+}
+
+
+void
+uaio_event_wait(struct uaio_task *task, struct uaio_event *e,
+        unsigned long timeout_us) {
+    uaio_waitqueue_push(&e->waiters, task);
+    if (timeout_us) {
+        uaio_task_sleep(task, timeout_us);
+        return;
+    }
+
+    task->status = UAIO_WAITING;
+}
+
+
+/* Called when the waiter resumes, a task still in the queue has been
+ * woken up by its timer. */
+int
+uaio_event_waitend(struct uaio_task *task) {
+    if (uaio_waitqueue_remove(task) == 0) {
+        return -1;
+    }
+
+    uaio_task_sleep_cancel(task);
+    return 0;
+}
@@ -21,13 +21,10 @@
 
 
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 
-#include "esp_timer.h"
-
-#ifdef CONFIG_UAIO_SELECT
-#include <time.h>
-#endif
 
 
 /* Generic stuff */
@@ -55,6 +52,60 @@ typedef unsigned long uaio_sleep_t;
 typedef void (*uaio_invoker) (struct uaio_task *self);
 
 
+/* Monotonic time in microseconds, compare it using UAIO_TIME_BEFORE only,
+ * so the type may be narrowed without breaking the wraparound. The compact
+ * 32 bit time wraps every 71 minutes, so no timeout may exceed
+ * UAIO_TIME_MAXSPAN. */
+#ifdef CONFIG_UAIO_COMPACT
+typedef uint32_t uaio_time_t;
+#define UAIO_TIME_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+#define UAIO_TIME_MAXSPAN 0x7fffffffUL
+#else
+typedef unsigned long long uaio_time_t;
+#define UAIO_TIME_BEFORE(a, b) ((long long)((a) - (b)) < 0)
+#define UAIO_TIME_MAXSPAN ((unsigned long)-1)
+#endif
+
+
+/* A deadline kept in the loop's timer heap, the owner task is woken up
+ * somewhere between the deadline and deadline + slack, so the close
+ * deadlines can be served by a single wakeup. A timer is always the sleep
+ * or the deadline member of its task, the task is derived from its
+ * address. The compact heap holds up to 65534 timers. */
+struct uaio_timer {
+    uaio_time_t deadline;
+#ifdef CONFIG_UAIO_COMPACT
+    uint32_t slack;
+    uint16_t index;
+#else
+    unsigned long slack;
+    size_t index;
+#endif
+
+    /* enum uaio_timerexpiry, what's done on expiry instead of just waking
+     * the task up */
+    uint8_t expiry;
+};
+
+
+/* Periodic deadlines, next = previous + period, so the period does not
+ * drift by the work and the scheduling delays. The ticks missed because of
+ * a late wakeup are skipped and counted as overruns. */
+struct uaio_ticker {
+    uaio_time_t next;
+    unsigned long period;
+    unsigned long overruns;
+};
+
+
+struct uaio_timerstats {
+    unsigned long armed;
+    unsigned long fired;
+    unsigned long wakeups;
+    unsigned long saved;
+};
+
+
 struct uaio_basecall {
     struct uaio_basecall *parent;
     int line;
@@ -62,34 +113,212 @@ struct uaio_basecall {
 };
 
 
+struct uaio_deadline;
+
+
 #ifdef CONFIG_UAIO_SEMAPHORE
     struct uaio_semaphore;
 #endif
 
 
+#ifdef CONFIG_UAIO_BUFPOOL
+    struct uaio_bufpool;
+    struct uaio_bufpoolclass;
+#endif
+
+
+#ifdef CONFIG_UAIO_OFFLOAD
+    struct uaio_offloadjob;
+    typedef int (*uaio_offload_t) (void *arg);
+#endif
+
+
+#ifdef CONFIG_UAIO_URING
+    struct uaio_uringop;
+#endif
+
+
+/* A producer coroutine frame, detached from any task while suspended. The
+ * consumer's UAIO_NEXT links it on top of its own call stack until the
+ * producer yields the next value, or finishes. */
+struct uaio_generator {
+    struct uaio_basecall *frame;
+    void *value;
+    bool yielded;
+
+    /* the generator running below this one in the task */
+    struct uaio_generator *outer;
+};
+
+
+/* Intrusive FIFO of the waiting tasks */
+struct uaio_waitqueue {
+    struct uaio_task *head;
+    struct uaio_task *tail;
+    size_t count;
+};
+
+
+/* What a waiting task is parked on, selects the member of the wait union
+ * in struct uaio_task */
+enum uaio_waitreason {
+    UAIO_WAIT_NONE,
+    UAIO_WAIT_QUEUE,
+    UAIO_WAIT_OFFLOAD,
+    UAIO_WAIT_URING,
+};
+
+
 struct uaio_task {
     struct uaio_basecall *current;
+#ifdef CONFIG_UAIO_COMPACT
+    /* enum uaio_taskstatus and enum uaio_waitreason */
+    uint8_t status;
+    uint8_t waitreason;
+    bool unwinding: 1;
+    bool timedout: 1;
+    int16_t eno;
+#else
     enum uaio_taskstatus status;
+    enum uaio_waitreason waitreason;
+    bool unwinding;
+    bool timedout;
     int eno;
-
-#ifdef CONFIG_UAIO_SELECT
-    struct timespec select_timestamp;
-    long select_timeout_us;
 #endif
 
 #ifdef CONFIG_UAIO_SEMAPHORE
     struct uaio_semaphore *semaphore;
 #endif
 
-    /* esp32 idf */
-    esp_timer_handle_t sleep;
+#ifdef CONFIG_UAIO_BUFPOOL
+    /* state drawn from a buffer pool by the spawn_bufpool helpers */
+    struct uaio_bufpool *bufpool;
+    void *pooled;
+
+    /* a free chunk of this class is held for the task */
+    struct uaio_bufpoolclass *bufheld;
+#endif
+
+#ifdef CONFIG_UAIO_OFFLOAD
+    int offloadresult;
+#endif
+
+#ifdef CONFIG_UAIO_URING
+    int uringresult;
+    unsigned char uringstate;
+#endif
+
+    /* A task waits for one thing at a time */
+    union {
+        /* UAIO_WAIT_QUEUE */
+        struct {
+            struct uaio_waitqueue *waitqueue;
+            struct uaio_task *waitprev;
+            struct uaio_task *waitnext;
+        };
+
+#ifdef CONFIG_UAIO_OFFLOAD
+        /* UAIO_WAIT_OFFLOAD */
+        struct uaio_offloadjob *offload;
+#endif
+
+#ifdef CONFIG_UAIO_URING
+        /* UAIO_WAIT_URING */
+        struct uaio_uringop *uring;
+#endif
+    };
+
+    struct uaio_timer sleep;
+
+    /* UAIO_AWAIT_TIMEOUT deadlines, innermost first. The timer is armed
+     * at the earliest one, its expiry unwinds all the frames above the
+     * outermost expired deadline's frame, the deadlineframe. */
+    struct uaio_timer deadline;
+    struct uaio_deadline *deadlines;
+    struct uaio_basecall *deadlineframe;
+
+    /* The generators running on top of the call stack, the innermost
+     * first, the loop clears their frame when it frees it */
+    struct uaio_generator *generators;
+
+#ifdef CONFIG_UAIO_ADMISSION
+    /* when the task started waiting for a free slot to spawn into, and
+     * whether a released slot is held for it */
+    uaio_time_t queued;
+    bool admitting;
+    bool reserved;
+#endif
+
+#ifdef CONFIG_UAIO_TASKDUMP
+    /* the status seen by the loop last time, and since when */
+    enum uaio_taskstatus seen;
+    uaio_time_t since;
+#endif
+};
+
+
+enum uaio_memcategory {
+    UAIO_MEM_CORE,
+    UAIO_MEM_TASKPOOL,
+    UAIO_MEM_EVENTS,
+    UAIO_MEM_FRAME,
+    UAIO_MEM_BUFFER,
+    UAIO_MEM_CATEGORIES,
+};
+
+
+/* Allocation hooks, the category tells which part of uaio asks for the
+ * memory, so the hot structures can be placed in the internal RAM. With
+ * CONFIG_UAIO_MEMSTATS each block carries a small size header, so the
+ * hooks are asked for a bit more than the caller. */
+struct uaio_allocator {
+    void * (*malloc) (size_t size, enum uaio_memcategory category,
+            void *arg);
+    void (*free) (void *ptr, enum uaio_memcategory category, void *arg);
+    void *arg;
+};
+
+
+struct uaio_memstats {
+    size_t allocs[UAIO_MEM_CATEGORIES];
+    size_t frees[UAIO_MEM_CATEGORIES];
+
+#ifdef CONFIG_UAIO_MEMSTATS
+    /* bytes in use, and the most ever used at once */
+    size_t bytes[UAIO_MEM_CATEGORIES];
+    size_t peak[UAIO_MEM_CATEGORIES];
+#endif
 };
 
 
+int
+uaio_allocator_set(const struct uaio_allocator *allocator);
+
+
+void *
+uaio_malloc(enum uaio_memcategory category, size_t size);
+
+
+void *
+uaio_calloc(enum uaio_memcategory category, size_t count, size_t size);
+
+
+void
+uaio_free(enum uaio_memcategory category, void *ptr);
+
+
+void
+uaio_memstats(struct uaio_memstats *out);
+
+
 int
 uaio_init(size_t maxtasks);
 
 
+int
+uaio_init_allocator(size_t maxtasks, const struct uaio_allocator *allocator);
+
+
 int
 uaio_destroy();
 
@@ -102,18 +331,295 @@ int
 uaio_task_dispose(struct uaio_task *task);
 
 
+#ifdef CONFIG_UAIO_ADMISSION
+
+
+/* waited_us sums the admission waits, rejected counts the spawns refused
+ * because the queue was full */
+struct uaio_admissionstats {
+    size_t depth;
+    size_t peakdepth;
+    unsigned long admitted;
+    unsigned long rejected;
+    unsigned long long waited_us;
+    unsigned long maxwait_us;
+};
+
+
+void
+uaio_admission_limit(size_t maxdepth);
+
+
+void
+uaio_admissionstats(struct uaio_admissionstats *out);
+
+
+int
+uaio_spawn_wait(struct uaio_task *task);
+
+
+void
+uaio_spawn_claim(struct uaio_task *task);
+
+
+void
+uaio_spawn_admitted(struct uaio_task *task);
+
+
+/* Spawns a new task, parks the spawner in a FIFO while the task pool is
+ * full. Throws ENOBUFS if the admission queue is full too. A released
+ * slot is held for the first spawner in the queue, so the others, and the
+ * fresh spawners, can't take it. */
+#define UAIO_SPAWN_AWAIT(task, entity, coro, ...) \
+    do { \
+        while (entity ## _spawn(coro, __VA_ARGS__)) { \
+            (task)->current->line = __LINE__; \
+            if (uaio_spawn_wait(task)) { \
+                UAIO_THROW(task); \
+            } \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            uaio_spawn_claim(task); \
+        } \
+        uaio_spawn_admitted(task); \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_ADMISSION
+
+
+#ifdef CONFIG_UAIO_TASKDUMP
+#include <stdio.h>
+
+
+#define UAIO_TASKINFO_MAXFRAMES 8
+
+
+/* Calls made by uaio_generic.h place the coroutine right after the base
+ * call, whatever the entity is */
+struct uaio_entitycall {
+    struct uaio_basecall;
+    void (*coro)();
+};
+
+
+struct uaio_frameinfo {
+    void (*coro)();
+    int line;
+};
+
+
+/* A snapshot of a task, frames are ordered from the innermost one and
+ * depth may exceed UAIO_TASKINFO_MAXFRAMES. fd is -1 when the task does
+ * not wait for a file, sleep and deadline are valid only when sleeping and
+ * deadlined are set. */
+struct uaio_taskinfo {
+    struct uaio_task *task;
+    enum uaio_taskstatus status;
+    int eno;
+    unsigned long elapsed_us;
+
+    size_t depth;
+    struct uaio_frameinfo frames[UAIO_TASKINFO_MAXFRAMES];
+
+    int fd;
+    int events;
+    bool sleeping;
+    bool deadlined;
+    uaio_time_t sleep;
+    uaio_time_t deadline;
+    struct uaio_waitqueue *waitqueue;
+#ifdef CONFIG_UAIO_SEMAPHORE
+    struct uaio_semaphore *semaphore;
+#endif
+};
+
+
+/* Walks the live tasks, starts with NULL. Both this and uaio_task_info()
+ * read the loop's state without locking, so call them from the loop's
+ * FreeRTOS task, e.g. a console coroutine. */
+struct uaio_task *
+uaio_task_walk(struct uaio_task *task);
+
+
+int
+uaio_task_info(struct uaio_task *task, struct uaio_taskinfo *out);
+
+
+/* Writes one line per live task and one per frame */
+int
+uaio_task_dump(FILE *out);
+
+
+#endif  // CONFIG_UAIO_TASKDUMP
+
+
 int
 uaio_loop();
 
 
+int
+uaio_run_once(unsigned long timeout_us, unsigned long *next_us);
+
+
 void
 uaio_task_killall();
 
 
+int
+uaio_generator_next(struct uaio_task *task, struct uaio_generator *gen);
+
+
+void
+uaio_generator_yield(struct uaio_task *task, struct uaio_generator *gen,
+        void *value);
+
+
+void *
+uaio_generator_take(struct uaio_generator *gen);
+
+
+void
+uaio_generator_close(struct uaio_task *task, struct uaio_generator *gen);
+
+
+#define UAIO_GENERATOR_DONE(gen) ((gen)->frame == NULL)
+
+
 void
 uaio_task_sleep(struct uaio_task *task, unsigned long us);
 
 
+void
+uaio_task_sleep_cancel(struct uaio_task *task);
+
+
+int
+uaio_task_deadline(struct uaio_task *task, unsigned long us);
+
+
+void
+uaio_task_deadline_end(struct uaio_task *task);
+
+
+void
+uaio_task_sleep_slack(struct uaio_task *task, unsigned long us,
+        unsigned long slack_us);
+
+
+uaio_time_t
+uaio_now();
+
+
+void
+uaio_ticker_start(struct uaio_ticker *ticker, unsigned long period_us);
+
+
+void
+uaio_ticker_wait(struct uaio_task *task, struct uaio_ticker *ticker);
+
+
+void
+uaio_timerstats(struct uaio_timerstats *out);
+
+
+/* Bytes of RAM taken by the loop per unit, excluding the allocator's own
+ * overhead and the size header of CONFIG_UAIO_MEMSTATS. A task costs
+ * pertask plus its frames, each frame of an entity is
+ * UAIO_FRAMESIZE(entity) bytes. */
+struct uaio_footprint {
+    size_t task;
+    size_t timerslots;
+    size_t pertask;
+    size_t frame;
+    size_t perfile;
+    size_t core;
+};
+
+
+void
+uaio_footprint(struct uaio_footprint *out);
+
+
+#define UAIO_FRAMESIZE(entity) sizeof(entity ## _call)
+
+
+#ifdef CONFIG_UAIO_BUSYPOLL
+
+
+/* saved_us is the measured wakeup latency of the idle hook, accumulated
+ * for each hit */
+struct uaio_busypollstats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long budget_us;
+    unsigned long long polled_us;
+    unsigned long long saved_us;
+};
+
+
+void
+uaio_busypollstats(struct uaio_busypollstats *out);
+
+
+#endif  // CONFIG_UAIO_BUSYPOLL
+
+
+/* Idle hooks are called whenever no task is runnable, timeout_us is the
+ * time until the next known deadline, or UAIO_IDLE_FOREVER. */
+#define UAIO_IDLE_FOREVER ((unsigned long)-1)
+typedef void (*uaio_idle_t) (unsigned long timeout_us, void *arg);
+
+
+int
+uaio_idle_set(uaio_idle_t hook, void *arg);
+
+
+/* Built-in idle policies */
+void
+uaio_idle_block(unsigned long timeout_us, void *arg);
+
+
+void
+uaio_idle_lightsleep(unsigned long timeout_us, void *arg);
+
+
+#ifdef __linux__
+
+
+void
+uaio_idle_ppoll(unsigned long timeout_us, void *arg);
+
+
+#if defined(CONFIG_UAIO_OFFLOAD) || defined(CONFIG_UAIO_PIPE)
+/* Ends a uaio_idle_ppoll from another thread */
+void
+uaio_idle_wakeup();
+#endif
+
+
+#endif
+
+
+/* Records the idle windows asked for into a ring, then idles with the
+ * wrapped policy. Handy to check the sleep pattern on the host. */
+struct uaio_idlerecorder {
+    /* uaio_idle_block if NULL */
+    uaio_idle_t hook;
+    void *arg;
+
+    /* the last size windows, count keeps growing */
+    unsigned long *windows;
+    size_t size;
+    size_t count;
+};
+
+
+void
+uaio_idle_record(unsigned long timeout_us, void *arg);
+
+
 #define UAIO_BEGIN(task) \
     switch ((task)->current->line) { \
         case 0:
@@ -157,42 +663,164 @@ uaio_task_sleep(struct uaio_task *task, unsigned long us);
     return
 
 
-#define UAIO_SLEEP(task, us) \
+/* Awaits the call, but unwinds it through the UAIO_FINALLY of each frame
+ * if it's not done in us microseconds. Then the task resumes here with
+ * UAIO_TASK_TIMEDOUT set and ETIMEDOUT as the error. Nested timeouts are
+ * allowed, the earliest expiry wins. The children spawned on a semaphore
+ * living in an unwound frame are detached from it on expiry. */
+#define UAIO_AWAIT_TIMEOUT(task, us, entity, coro, ...) \
     do { \
         (task)->current->line = __LINE__; \
-        uaio_task_sleep(task, us); \
+        if (uaio_task_deadline(task, us)) { \
+            (task)->eno = errno; \
+            (task)->status = UAIO_TERMINATING; \
+        } \
+        else if (entity ## _call_new(task, coro, __VA_ARGS__)) { \
+            uaio_task_deadline_end(task); \
+            (task)->status = UAIO_TERMINATING; \
+        } \
         errno = 0; \
         return; \
         case __LINE__:; \
+        uaio_task_deadline_end(task); \
     } while (0)
 
 
-#define UAIO_PASS(task, newstatus) \
+#define UAIO_TASK_TIMEDOUT(task) ((task)->timedout)
+
+
+#define UAIO_SLEEP(task, us) \
     do { \
         (task)->current->line = __LINE__; \
-        (task)->status = (newstatus); \
+        uaio_task_sleep(task, us); \
         errno = 0; \
         return; \
         case __LINE__:; \
     } while (0)
 
 
-#define UAIO_RETURN(task) \
-    (task)->eno = 0; \
-    (task)->status = UAIO_TERMINATING; \
-    errno = 0; \
-    return
+/* Sleeps at least us, but lets the loop wake the task up to slack_us later
+ * to batch it with the other deadlines */
+#define UAIO_SLEEP_SLACK(task, us, slack_us) \
+    do { \
+        (task)->current->line = __LINE__; \
+        uaio_task_sleep_slack(task, us, slack_us); \
+        errno = 0; \
+        return; \
+        case __LINE__:; \
+    } while (0)
 
 
-#define UAIO_HASERROR(task) (task->eno != 0)
-#define UAIO_ISERROR(task, e) (UAIO_HASERROR(task) && (task->eno == e))
-#define UAIO_CLEARERROR(task) task->eno = 0
+/* Waits for the next tick of a started ticker, using the task's own timer,
+ * so nothing is allocated per period */
+#define UAIO_EVERY(task, ticker) \
+    do { \
+        (task)->current->line = __LINE__; \
+        uaio_ticker_wait(task, ticker); \
+        errno = 0; \
+        return; \
+        case __LINE__:; \
+    } while (0)
 
 
-#ifdef CONFIG_UAIO_SELECT
+#define UAIO_TICKER_OVERRUNS(ticker) ((ticker)->overruns)
 
 
-/* IO helper macros */
+/* Resumes the generator until its next value, out is NULL when the
+ * generator is exhausted */
+#define UAIO_NEXT(task, gen, out) \
+    do { \
+        (task)->current->line = __LINE__; \
+        if (uaio_generator_next(task, gen)) { \
+            (out) = NULL; \
+        } \
+        else { \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            (out) = uaio_generator_take(gen); \
+        } \
+    } while (0)
+
+
+/* Hands the value over to the consumer, it's valid until the next
+ * UAIO_NEXT */
+#define UAIO_YIELD_VALUE(task, gen, value) \
+    do { \
+        (task)->current->line = __LINE__; \
+        uaio_generator_yield(task, gen, value); \
+        errno = 0; \
+        return; \
+        case __LINE__:; \
+    } while (0)
+
+
+#define UAIO_PASS(task, newstatus) \
+    do { \
+        (task)->current->line = __LINE__; \
+        (task)->status = (newstatus); \
+        errno = 0; \
+        return; \
+        case __LINE__:; \
+    } while (0)
+
+
+#define UAIO_RETURN(task) \
+    (task)->eno = 0; \
+    (task)->status = UAIO_TERMINATING; \
+    errno = 0; \
+    return
+
+
+#define UAIO_HASERROR(task) (task->eno != 0)
+#define UAIO_ISERROR(task, e) (UAIO_HASERROR(task) && (task->eno == e))
+#define UAIO_CLEARERROR(task) task->eno = 0
+
+
+#ifdef CONFIG_UAIO_OFFLOAD
+
+
+int
+uaio_offload(struct uaio_task *task, uaio_offload_t func, void *arg,
+        size_t size);
+
+
+/* Runs the blocking function on a worker thread, the task resumes when
+ * it's done with the errno in task->eno if it returned a negative value.
+ * A job keeps running when its task is killed or times out, so arg must
+ * outlive the job, it must not live in the coroutine's state. */
+#define UAIO_OFFLOAD(task, func, arg) UAIO_OFFLOAD_COPY(task, func, arg, 0)
+
+
+/* Like UAIO_OFFLOAD but the worker gets a private copy of size bytes of
+ * arg, copied back when the task resumes. arg may live in the state then,
+ * but the pointers inside it still must outlive the job. */
+#define UAIO_OFFLOAD_COPY(task, func, arg, size) \
+    do { \
+        (task)->current->line = __LINE__; \
+        if (uaio_offload(task, func, arg, size)) { \
+            (task)->eno = errno; \
+            (task)->status = UAIO_TERMINATING; \
+        } \
+        else { \
+            (task)->status = UAIO_WAITING; \
+        } \
+        errno = 0; \
+        return; \
+        case __LINE__:; \
+    } while (0)
+
+
+#define UAIO_OFFLOAD_RESULT(task) ((task)->offloadresult)
+
+
+#endif  // CONFIG_UAIO_OFFLOAD
+
+
+#ifdef CONFIG_UAIO_SELECT
+
+
+/* IO helper macros */
 #define UAIO_IN 0x1
 #define UAIO_ERR 0x2
 #define UAIO_OUT 0x4
@@ -209,6 +837,18 @@ int
 uaio_file_forget(int fd);
 
 
+struct uaio_fileinterest {
+    int fd;
+    int events;
+};
+
+
+/* Exports the files the tasks are waiting for, so an outer poller can
+ * drive uaio_run_once(). Returns the number of entries written. */
+int
+uaio_file_interest(struct uaio_fileinterest *out, size_t size);
+
+
 #define UAIO_FILE_AWAIT(task, fd, events) \
     do { \
         (task)->current->line = __LINE__; \
@@ -224,7 +864,8 @@ uaio_file_forget(int fd);
     } while (0)
 
 
-#define UAIO_FILE_TIMEDOUT(task) ((task)->select_timeout_us < 0)
+/* Deprecated, use UAIO_TASK_TIMEDOUT */
+#define UAIO_FILE_TIMEDOUT(task) UAIO_TASK_TIMEDOUT(task)
 #define UAIO_FILE_TWAIT(task, fd, events, us) \
     do { \
         (task)->current->line = __LINE__; \
@@ -243,6 +884,683 @@ uaio_file_forget(int fd);
 #endif  // CONFIG_UAIO_SELECT
 
 
+#ifdef CONFIG_UAIO_SOCKET
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+int
+uaio_socket_nonblock(int fd);
+
+
+/* Creates a non-blocking listening socket with SO_REUSEADDR, returns the
+ * file descriptor */
+int
+uaio_socket_listen(const struct sockaddr *addr, socklen_t addrlen,
+        int backlog);
+
+
+int
+uaio_socket_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+
+int
+uaio_socket_connectend(int fd);
+
+
+ssize_t
+uaio_socket_send(int fd, const void *buf, size_t size);
+
+
+/* Takes the ownership of the accepted socket, the acceptor closes it if
+ * this returns non-zero, e.g. when the handler pool is exhausted */
+typedef int (*uaio_accept_t) (int fd, void *arg);
+
+
+struct uaio_acceptor {
+    int fd;
+
+    /* most connections accepted per readiness, zero drains the backlog */
+    size_t batch;
+
+    uaio_accept_t accepted;
+    void *arg;
+
+    unsigned long connections;
+    unsigned long batches;
+    unsigned long dropped;
+
+    /* readiness with no file descriptor left to accept into */
+    unsigned long exhausted;
+};
+
+
+int
+uaio_acceptor_init(struct uaio_acceptor *a, int fd, size_t batch,
+        uaio_accept_t accepted, void *arg);
+
+
+int
+uaio_acceptor_drain(struct uaio_acceptor *a);
+
+
+int
+uaio_acceptor_wait(struct uaio_task *task, struct uaio_acceptor *a);
+
+
+#define UAIO_SOCKET_AWAIT(task, fd, events, expr) \
+    do { \
+        while ((expr) == -1) { \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+            UAIO_FILE_AWAIT(task, fd, events); \
+        } \
+    } while (0)
+
+
+#define UAIO_SOCKET_RECV(task, fd, buf, size, out) \
+    UAIO_SOCKET_AWAIT(task, fd, UAIO_IN, (out) = recv(fd, buf, size, 0))
+
+
+#define UAIO_SOCKET_SEND(task, fd, buf, size, out) \
+    UAIO_SOCKET_AWAIT(task, fd, UAIO_OUT, \
+            (out) = uaio_socket_send(fd, buf, size))
+
+
+/* Accepts a batch of connections and hands each of them to the acceptor's
+ * callback, out is the number of accepted connections. Backs off for
+ * CONFIG_UAIO_SOCKET_ACCEPT_BACKOFF_US when out of file descriptors. */
+#define UAIO_SOCKET_ACCEPT(task, a, out) \
+    do { \
+        while (((out) = uaio_acceptor_drain(a)) == -1) { \
+            (task)->current->line = __LINE__; \
+            if (uaio_acceptor_wait(task, a)) { \
+                UAIO_THROW(task); \
+            } \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+        } \
+    } while (0)
+
+
+/* Zero us waits for the connection forever */
+#define UAIO_SOCKET_CONNECT(task, fd, addr, addrlen, us) \
+    do { \
+        if (uaio_socket_connect(fd, addr, addrlen)) { \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+            UAIO_FILE_TWAIT(task, fd, UAIO_OUT, us); \
+            if (UAIO_TASK_TIMEDOUT(task)) { \
+                UAIO_THROW2(task, ETIMEDOUT); \
+            } \
+            if (uaio_socket_connectend(fd)) { \
+                UAIO_THROW(task); \
+            } \
+        } \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_SOCKET
+
+
+#ifdef CONFIG_UAIO_URING
+
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+/* These helpers use io_uring(7) when the kernel allows it and fall back
+ * to the select(2) module otherwise. */
+bool
+uaio_uring_available();
+
+
+ssize_t
+uaio_uring_read(struct uaio_task *task, int fd, void *buf, size_t size);
+
+
+ssize_t
+uaio_uring_write(struct uaio_task *task, int fd, const void *buf,
+        size_t size);
+
+
+ssize_t
+uaio_uring_recv(struct uaio_task *task, int fd, void *buf, size_t size,
+        int flags);
+
+
+ssize_t
+uaio_uring_send(struct uaio_task *task, int fd, const void *buf,
+        size_t size, int flags);
+
+
+int
+uaio_uring_accept(struct uaio_task *task, int fd, struct sockaddr *addr,
+        socklen_t *addrlen);
+
+
+int
+uaio_uring_connect(struct uaio_task *task, int fd,
+        const struct sockaddr *addr, socklen_t addrlen);
+
+
+#define UAIO_URING_AWAIT(task, out, expr) \
+    do { \
+        while (((out) = (expr)) == -1) { \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+            (task)->current->line = __LINE__; \
+            (task)->status = UAIO_WAITING; \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+        } \
+    } while (0)
+
+
+#define UAIO_URING_READ(task, fd, buf, size, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_read(task, fd, buf, size))
+
+
+#define UAIO_URING_WRITE(task, fd, buf, size, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_write(task, fd, buf, size))
+
+
+#define UAIO_URING_RECV(task, fd, buf, size, flags, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_recv(task, fd, buf, size, flags))
+
+
+#define UAIO_URING_SEND(task, fd, buf, size, flags, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_send(task, fd, buf, size, flags))
+
+
+#define UAIO_URING_ACCEPT(task, fd, addr, addrlen, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_accept(task, fd, addr, addrlen))
+
+
+#define UAIO_URING_CONNECT(task, fd, addr, addrlen, out) \
+    UAIO_URING_AWAIT(task, out, uaio_uring_connect(task, fd, addr, addrlen))
+
+
+#endif  // CONFIG_UAIO_URING
+
+
+#ifdef CONFIG_UAIO_STREAM
+
+
+#include <sys/types.h>
+
+
+struct uaio_streambuff {
+    char *data;
+    size_t size;
+    size_t head;
+    size_t len;
+};
+
+
+struct uaio_stream {
+    int fd;
+    struct uaio_streambuff rbuff;
+    struct uaio_streambuff wbuff;
+
+    /* bytes already searched for the delimiter by readuntil */
+    size_t scanned;
+
+    /* progress of the pending writeall */
+    size_t written;
+};
+
+
+int
+uaio_stream_init(struct uaio_stream *s, int fd, size_t rsize,
+        size_t wsize);
+
+
+int
+uaio_stream_deinit(struct uaio_stream *s);
+
+
+ssize_t
+uaio_stream_readsome(struct uaio_stream *s, char *buf, size_t size);
+
+
+ssize_t
+uaio_stream_readexactly(struct uaio_stream *s, char *buf, size_t size);
+
+
+ssize_t
+uaio_stream_readuntil(struct uaio_stream *s, char *buf, size_t size,
+        char delim);
+
+
+ssize_t
+uaio_stream_writeall(struct uaio_stream *s, const char *buf, size_t size);
+
+
+int
+uaio_stream_flush(struct uaio_stream *s);
+
+
+/* Retries the expression until it succeeds, parks the task only when the
+ * file is not ready. Zero from the read helpers means EOF, a readexactly
+ * or readuntil cut short by EOF throws ENODATA and leaves the partial data
+ * in the buffer. */
+#define UAIO_STREAM_AWAIT(task, s, events, expr) \
+    do { \
+        while ((expr) == -1) { \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+            UAIO_FILE_AWAIT(task, (s)->fd, events); \
+        } \
+    } while (0)
+
+
+#define UAIO_STREAM_READSOME(task, s, buf, size, out) \
+    UAIO_STREAM_AWAIT(task, s, UAIO_IN, \
+            (out) = uaio_stream_readsome(s, buf, size))
+
+
+#define UAIO_STREAM_READEXACTLY(task, s, buf, size, out) \
+    UAIO_STREAM_AWAIT(task, s, UAIO_IN, \
+            (out) = uaio_stream_readexactly(s, buf, size))
+
+
+#define UAIO_STREAM_READUNTIL(task, s, buf, size, delim, out) \
+    UAIO_STREAM_AWAIT(task, s, UAIO_IN, \
+            (out) = uaio_stream_readuntil(s, buf, size, delim))
+
+
+#define UAIO_STREAM_WRITEALL(task, s, buf, size) \
+    UAIO_STREAM_AWAIT(task, s, UAIO_OUT, \
+            uaio_stream_writeall(s, buf, size))
+
+
+#define UAIO_STREAM_FLUSH(task, s) \
+    UAIO_STREAM_AWAIT(task, s, UAIO_OUT, uaio_stream_flush(s))
+
+
+#endif  // CONFIG_UAIO_STREAM
+
+
+#ifdef CONFIG_UAIO_TRANSFER
+
+
+enum uaio_transfermode {
+    UAIO_TRANSFER_BUFFERED,
+    UAIO_TRANSFER_SENDFILE,
+    UAIO_TRANSFER_SPLICE,
+    UAIO_TRANSFER_SPLICEDIRECT,
+};
+
+
+struct uaio_transfer;
+typedef void (*uaio_transferprogress_t) (struct uaio_transfer *t);
+
+
+/* Moves bytes between two files without copying them to the user space
+ * where the platform allows: sendfile(2) for regular files and splice(2)
+ * for the others on Linux, a plain read/write buffer elsewhere. */
+struct uaio_transfer {
+    int infd;
+    int outfd;
+    enum uaio_transfermode mode;
+
+    /* zero means until EOF */
+    size_t limit;
+    size_t done;
+
+    /* optional, called whenever some bytes are transferred */
+    uaio_transferprogress_t progress;
+    void *userptr;
+
+    /* bytes read but not written yet */
+    size_t pending;
+    int pipe[2];
+    char *buff;
+    size_t buffsize;
+    size_t head;
+
+    /* what the transfer is blocked on */
+    int waitfd;
+    int waitevents;
+};
+
+
+int
+uaio_transfer_init(struct uaio_transfer *t, int infd, int outfd,
+        size_t limit, size_t buffsize);
+
+
+int
+uaio_transfer_deinit(struct uaio_transfer *t);
+
+
+int
+uaio_transfer_step(struct uaio_transfer *t);
+
+
+#define UAIO_TRANSFER(task, t) \
+    do { \
+        while (uaio_transfer_step(t)) { \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+            UAIO_FILE_AWAIT(task, (t)->waitfd, (t)->waitevents); \
+        } \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_TRANSFER
+
+
+#ifdef CONFIG_UAIO_WQUEUE
+
+
+struct uaio_wqentry {
+    const char *buf;
+    size_t size;
+    size_t done;
+    struct uaio_task *task;
+    struct uaio_wqentry *next;
+};
+
+
+/* Per file outbound queue, coalesces the pending writes of many tasks */
+struct uaio_wqueue {
+    int fd;
+    struct uaio_wqentry *head;
+    struct uaio_wqentry *tail;
+};
+
+
+int
+uaio_wqueue_init(struct uaio_wqueue *q, int fd);
+
+
+void
+uaio_wqueue_push(struct uaio_wqueue *q, struct uaio_wqentry *e,
+        struct uaio_task *task, const char *buf, size_t size);
+
+
+int
+uaio_wqueue_park(struct uaio_task *task, struct uaio_wqueue *q,
+        struct uaio_wqentry *e);
+
+
+int
+uaio_wqueue_flush(struct uaio_wqueue *q, struct uaio_wqentry *e);
+
+
+int
+uaio_wqueue_cancel(struct uaio_wqueue *q, struct uaio_wqentry *e);
+
+
+/* The entry must live until the macro finishes, so it usually belongs to
+ * the coroutine state. Call uaio_wqueue_cancel inside the UAIO_FINALLY
+ * block if the task may be killed while writing. */
+#define UAIO_WQUEUE_WRITE(task, q, e, buf, size) \
+    do { \
+        uaio_wqueue_push(q, e, task, buf, size); \
+        while (1) { \
+            (task)->current->line = __LINE__; \
+            if (uaio_wqueue_park(task, q, e)) { \
+                (task)->status = UAIO_TERMINATING; \
+            } \
+            else { \
+                (task)->status = UAIO_WAITING; \
+            } \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            if (uaio_wqueue_flush(q, e) == 0) { \
+                break; \
+            } \
+            if (!UAIO_MUSTWAIT(errno)) { \
+                UAIO_THROW(task); \
+            } \
+        } \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_WQUEUE
+
+
+#ifdef CONFIG_UAIO_BUFPOOL
+
+
+#include <stdint.h>
+
+
+struct uaio_bufpoolclass {
+    size_t size;
+    size_t count;
+    size_t available;
+    char *slab;
+    void *freelist;
+    struct uaio_waitqueue waiters;
+
+    /* free chunks held for the woken waiters */
+    size_t held;
+};
+
+
+/* Fixed size class slab allocator */
+struct uaio_bufpool {
+    struct uaio_bufpoolclass *classes;
+    size_t classescount;
+
+    /* heap_caps_malloc(3) capabilities of the slabs, zero to use the uaio
+     * allocator */
+    uint32_t caps;
+};
+
+
+int
+uaio_bufpool_init(struct uaio_bufpool *p, const size_t *sizes,
+        const size_t *counts, size_t classes, uint32_t caps);
+
+
+int
+uaio_bufpool_deinit(struct uaio_bufpool *p);
+
+
+void *
+uaio_bufpool_get(struct uaio_bufpool *p, size_t size);
+
+
+int
+uaio_bufpool_put(struct uaio_bufpool *p, void *ptr);
+
+
+int
+uaio_bufpool_wait(struct uaio_task *task, struct uaio_bufpool *p,
+        size_t size);
+
+
+void *
+uaio_bufpool_claim(struct uaio_task *task, struct uaio_bufpool *p,
+        size_t size);
+
+
+void
+uaio_bufpool_unhold(struct uaio_task *task);
+
+
+/* Waits for a free chunk when the pool is exhausted. A returned chunk is
+ * held for the first waiter, so the others can't take it. */
+#define UAIO_BUFPOOL_GET(task, p, size, out) \
+    do { \
+        while (((out) = uaio_bufpool_claim(task, p, size)) == NULL) { \
+            if (errno != EAGAIN) { \
+                UAIO_THROW(task); \
+            } \
+            (task)->current->line = __LINE__; \
+            if (uaio_bufpool_wait(task, p, size)) { \
+                (task)->status = UAIO_TERMINATING; \
+            } \
+            else { \
+                (task)->status = UAIO_WAITING; \
+            } \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+        } \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_BUFPOOL
+
+
+#ifdef CONFIG_UAIO_EVENT
+
+
+#include <stdbool.h>
+
+
+/* Level triggered flag, setting it wakes up all the waiters at once */
+struct uaio_event {
+    bool set;
+    struct uaio_waitqueue waiters;
+};
+
+
+void
+uaio_event_init(struct uaio_event *e, bool set);
+
+
+void
+uaio_event_set(struct uaio_event *e);
+
+
+void
+uaio_event_clear(struct uaio_event *e);
+
+
+void
+uaio_event_pulse(struct uaio_event *e);
+
+
+void
+uaio_event_wait(struct uaio_task *task, struct uaio_event *e,
+        unsigned long timeout_us);
+
+
+int
+uaio_event_waitend(struct uaio_task *task);
+
+
+#define UAIO_EVENT_WAIT(task, e) \
+    do { \
+        if (!(e)->set) { \
+            (task)->current->line = __LINE__; \
+            uaio_event_wait(task, e, 0); \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            uaio_event_waitend(task); \
+        } \
+    } while (0)
+
+
+/* out is zero if the event is set, -1 if the timeout is reached first */
+#define UAIO_EVENT_TWAIT(task, e, us, out) \
+    do { \
+        (out) = 0; \
+        if (!(e)->set) { \
+            (task)->current->line = __LINE__; \
+            uaio_event_wait(task, e, us); \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            (out) = uaio_event_waitend(task); \
+        } \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_EVENT
+
+
+#ifdef CONFIG_UAIO_PIPE
+
+
+/* Single producer, single consumer byte ring. The producer may run in an
+ * ISR, the reader coroutine is woken up by the loop once the threshold is
+ * reached. */
+struct uaio_pipe {
+    unsigned char *buff;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t threshold;
+
+    /* set by the producer when it notifies the loop, cleared by the loop
+     * on each iteration, so the notifications are coalesced */
+    bool signaled;
+    void *looptask;
+
+    struct uaio_waitqueue readers;
+    struct uaio_pipe *next;
+};
+
+
+int
+uaio_pipe_init(struct uaio_pipe *p, size_t size);
+
+
+int
+uaio_pipe_deinit(struct uaio_pipe *p);
+
+
+size_t
+uaio_pipe_push(struct uaio_pipe *p, const void *data, size_t len);
+
+
+size_t
+uaio_pipe_available(struct uaio_pipe *p);
+
+
+size_t
+uaio_pipe_read(struct uaio_pipe *p, void *buf, size_t size);
+
+
+void
+uaio_pipe_wait(struct uaio_task *task, struct uaio_pipe *p,
+        size_t threshold, unsigned long timeout_us);
+
+
+int
+uaio_pipe_waitend(struct uaio_task *task);
+
+
+/* Waits for threshold bytes, or the timeout if us is not zero, then reads
+ * whatever is available up to size into buf */
+#define UAIO_PIPE_READ(task, p, buf, size, threshold, us, out) \
+    do { \
+        if (uaio_pipe_available(p) < (threshold)) { \
+            (task)->current->line = __LINE__; \
+            uaio_pipe_wait(task, p, threshold, us); \
+            errno = 0; \
+            return; \
+            case __LINE__:; \
+            uaio_pipe_waitend(task); \
+        } \
+        (out) = uaio_pipe_read(p, buf, size); \
+    } while (0)
+
+
+#endif  // CONFIG_UAIO_PIPE
+
+
 #ifdef CONFIG_UAIO_SEMAPHORE
 
 
@@ -257,4 +1575,24 @@ uaio_semaphore_release(struct uaio_task *task);
 #endif  // CONFIG_UAIO_SEMAPHORE
 
 
+#ifdef CONFIG_UAIO_SIMTIME
+
+
+/* Scripted file readiness for the simulated time mode, must return the
+ * subset of the events which are ready at the given virtual time. */
+typedef int (*uaio_simbackend_t) (int fd, int events,
+        unsigned long long now_us);
+
+
+void
+uaio_simtime_backend(uaio_simbackend_t backend);
+
+
+unsigned long long
+uaio_simtime_now();
+
+
+#endif  // CONFIG_UAIO_SIMTIME
+
+
 #endif  // UAIO_H_
@@ -17,6 +17,7 @@
  *  Author: Vahid Mardani <vahid.mardani@gmail.com>
  */
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <uaio.h>
@@ -26,7 +27,11 @@ void
 UAIO_NAME(invoker)(struct uaio_task *task) {
     struct UAIO_NAME(call) *call = (struct UAIO_NAME(call)*) task->current;
 
+#ifdef UAIO_INLINESTATE
+    call->coro(task, &call->state
+#else
     call->coro(task, call->state
+#endif  // UAIO_INLINESTATE
 #ifdef UAIO_ARG1
         , call->arg1
     #ifdef UAIO_ARG2
@@ -49,14 +54,23 @@ UAIO_NAME(call_new)(struct uaio_task *task, UAIO_NAME(coro_t) coro,
         ) {
     struct UAIO_NAME(call) *call;
 
-    call = malloc(sizeof(struct UAIO_NAME(call)));
+    call = uaio_malloc(UAIO_MEM_FRAME, sizeof(struct UAIO_NAME(call)));
     if (call == NULL) {
         return -1;
     }
 
     call->parent = task->current;
     call->coro = coro;
+#ifdef UAIO_INLINESTATE
+    if (state) {
+        memcpy(&call->state, state, sizeof(UAIO_NAME(t)));
+    }
+    else {
+        memset(&call->state, 0, sizeof(UAIO_NAME(t)));
+    }
+#else
     call->state = state;
+#endif  // UAIO_INLINESTATE
     call->line = 0;
     call->invoke = UAIO_NAME(invoker);
 
@@ -74,6 +88,54 @@ UAIO_NAME(call_new)(struct uaio_task *task, UAIO_NAME(coro_t) coro,
 }
 
 
+int
+UAIO_NAME(generator_new)(struct uaio_generator *gen, UAIO_NAME(coro_t) coro,
+        UAIO_NAME(t) *state
+#ifdef UAIO_ARG1
+        , UAIO_ARG1 arg1
+    #ifdef UAIO_ARG2
+            , UAIO_ARG2 arg2
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+        ) {
+    struct UAIO_NAME(call) *call;
+
+    call = uaio_malloc(UAIO_MEM_FRAME, sizeof(struct UAIO_NAME(call)));
+    if (call == NULL) {
+        return -1;
+    }
+
+    call->parent = NULL;
+    call->coro = coro;
+#ifdef UAIO_INLINESTATE
+    if (state) {
+        memcpy(&call->state, state, sizeof(UAIO_NAME(t)));
+    }
+    else {
+        memset(&call->state, 0, sizeof(UAIO_NAME(t)));
+    }
+#else
+    call->state = state;
+#endif  // UAIO_INLINESTATE
+    call->line = 0;
+    call->invoke = UAIO_NAME(invoker);
+
+    /* arguments */
+#ifdef UAIO_ARG1
+    call->arg1 = arg1;
+    #ifdef UAIO_ARG2
+        call->arg2 = arg2;
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+
+    gen->frame = (struct uaio_basecall*) call;
+    gen->value = NULL;
+    gen->yielded = false;
+    gen->outer = NULL;
+    return 0;
+}
+
+
 int
 UAIO_NAME(spawn) (UAIO_NAME(coro_t) coro, UAIO_NAME(t) *state
 #ifdef UAIO_ARG1
@@ -151,3 +213,57 @@ failure:
 }
 
 #endif
+
+
+#if defined(CONFIG_UAIO_BUFPOOL) && !defined(UAIO_INLINESTATE)
+
+
+int
+UAIO_NAME(spawn_bufpool) (struct uaio_bufpool *pool, UAIO_NAME(coro_t) coro
+#ifdef UAIO_ARG1
+        , UAIO_ARG1 arg1
+    #ifdef UAIO_ARG2
+            , UAIO_ARG2 arg2
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+        ) {
+    struct uaio_task *task = NULL;
+    UAIO_NAME(t) *state;
+
+    state = uaio_bufpool_get(pool, sizeof(UAIO_NAME(t)));
+    if (state == NULL) {
+        return -1;
+    }
+    memset(state, 0, sizeof(UAIO_NAME(t)));
+
+    task = uaio_task_new();
+    if (task == NULL) {
+        goto failure;
+    }
+
+    task->bufpool = pool;
+    task->pooled = state;
+
+    if (UAIO_NAME(call_new)(task, coro, state
+#ifdef UAIO_ARG1
+        , arg1
+    #ifdef UAIO_ARG2
+            , arg2
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+        )) {  // NOLINT
+        goto failure;
+    }
+
+    return 0;
+
+failure:
+    if (task) {
+        uaio_task_dispose(task);
+    }
+    uaio_bufpool_put(pool, state);
+    return -1;
+}
+
+
+#endif  // CONFIG_UAIO_BUFPOOL && !UAIO_INLINESTATE
@@ -30,10 +30,19 @@ typedef void (*UAIO_NAME(coro_t)) (struct uaio_task *self, UAIO_NAME(t) *state
 
 
 /* call */
+/* Keep coro right after the base call, see struct uaio_entitycall.
+ * With UAIO_INLINESTATE the state lives in the frame: the state given to
+ * call_new, generator_new and spawn is copied in, or zeroed if NULL, and
+ * freed with the frame when the coroutine returns. Pass any number of
+ * inputs in the state, and results through pointers it holds. */
 typedef struct UAIO_NAME(call) {
     struct uaio_basecall;
     UAIO_NAME(coro_t) coro;
+#ifdef UAIO_INLINESTATE
+    UAIO_NAME(t) state;
+#else
     UAIO_NAME(t) *state;
+#endif  // UAIO_INLINESTATE
 
 #ifdef UAIO_ARG1
     UAIO_ARG1 arg1;
@@ -60,6 +69,19 @@ UAIO_NAME(call_new)(struct uaio_task *task, UAIO_NAME(coro_t) coro,
         );  // NOLINT
 
 
+/* Prepares a suspended producer frame, it starts on the first UAIO_NEXT */
+int
+UAIO_NAME(generator_new)(struct uaio_generator *gen, UAIO_NAME(coro_t) coro,
+        UAIO_NAME(t) *state
+#ifdef UAIO_ARG1
+        , UAIO_ARG1 arg1
+    #ifdef UAIO_ARG2
+            , UAIO_ARG2 arg2
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+        );  // NOLINT
+
+
 int
 UAIO_NAME(spawn) (UAIO_NAME(coro_t) coro, UAIO_NAME(t) *state
 #ifdef UAIO_ARG1
@@ -81,3 +103,22 @@ UAIO_NAME(spawn_semaphore) (struct uaio_semaphore *semaphore,
     #endif  // UAIO_ARG2
 #endif  // UAIO_ARG1
         );  // NOLINT
+
+
+/* The state drawn from the pool would be copied into the frame anyway */
+#if defined(CONFIG_UAIO_BUFPOOL) && !defined(UAIO_INLINESTATE)
+
+
+/* Draws a zeroed state from the pool, it's put back when the task ends */
+int
+UAIO_NAME(spawn_bufpool) (struct uaio_bufpool *pool, UAIO_NAME(coro_t) coro
+#ifdef UAIO_ARG1
+        , UAIO_ARG1 arg1
+    #ifdef UAIO_ARG2
+            , UAIO_ARG2 arg2
+    #endif  // UAIO_ARG2
+#endif  // UAIO_ARG1
+        );  // NOLINT
+
+
+#endif  // CONFIG_UAIO_BUFPOOL && !UAIO_INLINESTATE
@@ -0,0 +1,151 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "uaio.h"
+
+
+static void *
+_default_malloc(size_t size, enum uaio_memcategory category, void *arg) {
+    return malloc(size);
+}
+
+
+static void
+_default_free(void *ptr, enum uaio_memcategory category, void *arg) {
+    free(ptr);
+}
+
+
+static const struct uaio_allocator _default = {
+    .malloc = _default_malloc,
+    .free = _default_free,
+    .arg = NULL,
+};
+
+
+#ifdef CONFIG_UAIO_MEMSTATS
+/* Prepended to each block to know its size when it's freed */
+union _header {
+    size_t size;
+    max_align_t align;
+};
+#endif
+
+
+static const struct uaio_allocator *_allocator = &_default;
+static struct uaio_memstats _stats;
+
+
+int
+uaio_allocator_set(const struct uaio_allocator *allocator) {
+    if (allocator == NULL) {
+        _allocator = &_default;
+        return 0;
+    }
+
+    if ((allocator->malloc == NULL) || (allocator->free == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _allocator = allocator;
+    return 0;
+}
+
+
+void *
+uaio_malloc(enum uaio_memcategory category, size_t size) {
+#ifdef CONFIG_UAIO_MEMSTATS
+    union _header *h;
+
+    if (size > (SIZE_MAX - sizeof(union _header))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    h = _allocator->malloc(sizeof(union _header) + size, category,
+            _allocator->arg);
+    if (h == NULL) {
+        return NULL;
+    }
+
+    h->size = size;
+    _stats.allocs[category]++;
+    _stats.bytes[category] += size;
+    if (_stats.bytes[category] > _stats.peak[category]) {
+        _stats.peak[category] = _stats.bytes[category];
+    }
+    return h + 1;
+#else
+    void *ptr = _allocator->malloc(size, category, _allocator->arg);
+
+    if (ptr) {
+        _stats.allocs[category]++;
+    }
+    return ptr;
+#endif
+}
+
+
+void *
+uaio_calloc(enum uaio_memcategory category, size_t count, size_t size) {
+    void *ptr;
+
+    if (size && (count > (SIZE_MAX / size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ptr = uaio_malloc(category, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+
+void
+uaio_free(enum uaio_memcategory category, void *ptr) {
+#ifdef CONFIG_UAIO_MEMSTATS
+    union _header *h;
+#endif
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    _stats.frees[category]++;
+#ifdef CONFIG_UAIO_MEMSTATS
+    h = (union _header *)ptr - 1;
+    _stats.bytes[category] -= h->size;
+    ptr = h;
+#endif
+    _allocator->free(ptr, category, _allocator->arg);
+}
+
+
+void
+uaio_memstats(struct uaio_memstats *out) {
+    memcpy(out, &_stats, sizeof(struct uaio_memstats));
+}
@@ -0,0 +1,227 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <string.h>
+#include <errno.h>
+
+#include "uaio.h"
+#include "offload.h"
+
+
+static void *
+_worker(void *arg) {
+    struct uaio_offload *o = arg;
+    struct uaio_offloadjob *job;
+    TaskHandle_t looptask;
+
+    pthread_mutex_lock(&o->mutex);
+    while (!o->stop) {
+        job = o->pending;
+        if (job == NULL) {
+            pthread_cond_wait(&o->cond, &o->mutex);
+            continue;
+        }
+
+        o->pending = job->next;
+        if (o->pending == NULL) {
+            o->pendingtail = NULL;
+        }
+        pthread_mutex_unlock(&o->mutex);
+
+        errno = 0;
+        if (job->copy) {
+            job->result = job->func(job->copy);
+        }
+        else {
+            job->result = job->func(job->arg);
+        }
+        job->eno = (job->result < 0)? errno: 0;
+
+        pthread_mutex_lock(&o->mutex);
+        job->next = o->done;
+        __atomic_store_n(&o->done, job, __ATOMIC_RELEASE);
+        looptask = o->looptask;
+        pthread_mutex_unlock(&o->mutex);
+
+        /* Wake up the loop if it's idle */
+        if (looptask) {
+            xTaskNotifyGiveIndexed(looptask, CONFIG_UAIO_NOTIFY_INDEX);
+#ifdef __linux__
+            uaio_idle_wakeup();
+#endif
+        }
+
+        pthread_mutex_lock(&o->mutex);
+    }
+    pthread_mutex_unlock(&o->mutex);
+
+    return NULL;
+}
+
+
+int
+uaio_offload_init(struct uaio_offload *o) {
+    int i;
+
+    memset(o, 0, sizeof(struct uaio_offload));
+    for (i = 0; i < CONFIG_UAIO_OFFLOAD_QUEUESIZE; i++) {
+        o->jobs[i].next = o->free;
+        o->free = &o->jobs[i];
+    }
+
+    if (pthread_mutex_init(&o->mutex, NULL)) {
+        return -1;
+    }
+
+    if (pthread_cond_init(&o->cond, NULL)) {
+        pthread_mutex_destroy(&o->mutex);
+        return -1;
+    }
+
+    for (i = 0; i < CONFIG_UAIO_OFFLOAD_WORKERS; i++) {
+        if (pthread_create(&o->workers[i], NULL, _worker, o)) {
+            uaio_offload_deinit(o);
+            return -1;
+        }
+        o->workerscount++;
+    }
+
+    return 0;
+}
+
+
+int
+uaio_offload_deinit(struct uaio_offload *o) {
+    size_t i;
+
+    pthread_mutex_lock(&o->mutex);
+    o->stop = true;
+    pthread_cond_broadcast(&o->cond);
+    pthread_mutex_unlock(&o->mutex);
+
+    for (i = 0; i < o->workerscount; i++) {
+        pthread_join(o->workers[i], NULL);
+    }
+    o->workerscount = 0;
+
+    /* Jobs done after the last tick */
+    for (i = 0; i < CONFIG_UAIO_OFFLOAD_QUEUESIZE; i++) {
+        uaio_free(UAIO_MEM_BUFFER, o->jobs[i].copy);
+        o->jobs[i].copy = NULL;
+    }
+
+    pthread_cond_destroy(&o->cond);
+    pthread_mutex_destroy(&o->mutex);
+    return 0;
+}
+
+
+/* A non-zero size makes the worker run on a copy of arg, which is copied
+ * back when the job is done, or dropped if the task is gone by then */
+int
+uaio_offload_submit(struct uaio_offload *o, struct uaio_task *task,
+        uaio_offload_t func, void *arg, size_t size) {
+    struct uaio_offloadjob *job = o->free;
+    void *copy = NULL;
+
+    if (job == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (size) {
+        copy = uaio_malloc(UAIO_MEM_BUFFER, size);
+        if (copy == NULL) {
+            return -1;
+        }
+        memcpy(copy, arg, size);
+    }
+    o->free = job->next;
+
+    job->func = func;
+    job->arg = arg;
+    job->copy = copy;
+    job->size = size;
+    job->result = 0;
+    job->eno = 0;
+    job->task = task;
+    job->next = NULL;
+    task->waitreason = UAIO_WAIT_OFFLOAD;
+    task->offload = job;
+
+    pthread_mutex_lock(&o->mutex);
+    o->looptask = xTaskGetCurrentTaskHandle();
+    if (o->pendingtail) {
+        o->pendingtail->next = job;
+    }
+    else {
+        o->pending = job;
+    }
+    o->pendingtail = job;
+    pthread_cond_signal(&o->cond);
+    pthread_mutex_unlock(&o->mutex);
+    return 0;
+}
+
+
+/* Called by the loop on each iteration, resumes the tasks whose jobs are
+ * done. Returns the number of completed jobs. */
+int
+uaio_offload_tick(struct uaio_offload *o) {
+    struct uaio_offloadjob *job;
+    struct uaio_offloadjob *next;
+    struct uaio_task *task;
+    int count = 0;
+
+    if (__atomic_load_n(&o->done, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&o->mutex);
+    job = o->done;
+    o->done = NULL;
+    pthread_mutex_unlock(&o->mutex);
+
+    while (job) {
+        next = job->next;
+        task = job->task;
+        if (task) {
+            task->waitreason = UAIO_WAIT_NONE;
+            task->offload = NULL;
+            task->offloadresult = job->result;
+            task->eno = job->eno;
+            if (job->copy) {
+                memcpy(job->arg, job->copy, job->size);
+            }
+
+            if (task->status == UAIO_WAITING) {
+                task->status = UAIO_RUNNING;
+            }
+        }
+
+        uaio_free(UAIO_MEM_BUFFER, job->copy);
+        job->copy = NULL;
+
+        job->next = o->free;
+        o->free = job;
+        job = next;
+        count++;
+    }
+
+    return count;
+}
@@ -0,0 +1,86 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_
+
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "uaio.h"
+
+
+struct uaio_offloadjob {
+    uaio_offload_t func;
+    void *arg;
+
+    /* the job's own copy of arg, if any, so an orphaned job never touches
+     * the caller's memory */
+    void *copy;
+    size_t size;
+    int result;
+    int eno;
+
+    /* NULL when the task is disposed before the job is done */
+    struct uaio_task *task;
+    struct uaio_offloadjob *next;
+};
+
+
+struct uaio_offload {
+    pthread_t workers[CONFIG_UAIO_OFFLOAD_WORKERS];
+    size_t workerscount;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop;
+
+    /* the task running the loop, notified on completion */
+    TaskHandle_t looptask;
+
+    /* owned by the loop */
+    struct uaio_offloadjob jobs[CONFIG_UAIO_OFFLOAD_QUEUESIZE];
+    struct uaio_offloadjob *free;
+
+    /* guarded by the mutex */
+    struct uaio_offloadjob *pending;
+    struct uaio_offloadjob *pendingtail;
+    struct uaio_offloadjob *done;
+};
+
+
+int
+uaio_offload_init(struct uaio_offload *o);
+
+
+int
+uaio_offload_deinit(struct uaio_offload *o);
+
+
+int
+uaio_offload_submit(struct uaio_offload *o, struct uaio_task *task,
+        uaio_offload_t func, void *arg, size_t size);
+
+
+int
+uaio_offload_tick(struct uaio_offload *o);
+
+
+#endif  // OFFLOAD_H_
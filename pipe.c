@@ -0,0 +1,200 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <errno.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "uaio.h"
+#include "pipe.h"
+#include "waitqueue.h"
+
+
+#define MASK(p, i) ((i) & ((p)->size - 1))
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, n) __atomic_store_n(&(v), n, __ATOMIC_RELEASE)
+
+
+/* Pipes visited by the loop on each iteration, owned by the loop */
+static struct uaio_pipe *_pipes = NULL;
+
+
+int
+uaio_pipe_init(struct uaio_pipe *p, size_t size) {
+    /* The ring indexes are masked, so the size must be a power of two */
+    if ((size == 0) || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(p, 0, sizeof(struct uaio_pipe));
+    p->buff = uaio_malloc(UAIO_MEM_BUFFER, size);
+    if (p->buff == NULL) {
+        return -1;
+    }
+
+    p->size = size;
+    p->next = _pipes;
+    _pipes = p;
+    return 0;
+}
+
+
+int
+uaio_pipe_deinit(struct uaio_pipe *p) {
+    struct uaio_pipe **pp;
+
+    if (p->buff == NULL) {
+        return -1;
+    }
+
+    for (pp = &_pipes; *pp; pp = &(*pp)->next) {
+        if (*pp == p) {
+            *pp = p->next;
+            break;
+        }
+    }
+
+    uaio_free(UAIO_MEM_BUFFER, p->buff);
+    p->buff = NULL;
+    return 0;
+}
+
+
+/* Copies as much as fits and returns the amount, safe to call from an ISR
+ * as long as there is one producer. */
+size_t
+uaio_pipe_push(struct uaio_pipe *p, const void *data, size_t len) {
+    size_t head = p->head;
+    size_t tail = LOAD(p->tail);
+    size_t offset = MASK(p, head);
+    size_t chunk;
+    BaseType_t woken = pdFALSE;
+
+    if (len > (p->size - (head - tail))) {
+        len = p->size - (head - tail);
+    }
+
+    chunk = p->size - offset;
+    if (chunk > len) {
+        chunk = len;
+    }
+    memcpy(p->buff + offset, data, chunk);
+    memcpy(p->buff, (const unsigned char *)data + chunk, len - chunk);
+    STORE(p->head, head + len);
+
+    if ((p->readers.head == NULL) || (LOAD(p->looptask) == NULL) ||
+            ((head + len - tail) < p->threshold) ||
+            __atomic_exchange_n(&p->signaled, true, __ATOMIC_ACQ_REL)) {
+        return len;
+    }
+
+    if (xPortInIsrContext()) {
+        vTaskNotifyGiveIndexedFromISR(p->looptask,
+                CONFIG_UAIO_NOTIFY_INDEX, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+    else {
+        xTaskNotifyGiveIndexed(p->looptask, CONFIG_UAIO_NOTIFY_INDEX);
+    }
+
+#ifdef __linux__
+    uaio_idle_wakeup();
+#endif
+    return len;
+}
+
+
+size_t
+uaio_pipe_available(struct uaio_pipe *p) {
+    return LOAD(p->head) - p->tail;
+}
+
+
+size_t
+uaio_pipe_read(struct uaio_pipe *p, void *buf, size_t size) {
+    size_t tail = p->tail;
+    size_t len = uaio_pipe_available(p);
+    size_t offset = MASK(p, tail);
+    size_t chunk;
+
+    if (len > size) {
+        len = size;
+    }
+
+    chunk = p->size - offset;
+    if (chunk > len) {
+        chunk = len;
+    }
+    memcpy(buf, p->buff + offset, chunk);
+    memcpy((unsigned char *)buf + chunk, p->buff, len - chunk);
+    STORE(p->tail, tail + len);
+    return len;
+}
+
+
+void
+uaio_pipe_wait(struct uaio_task *task, struct uaio_pipe *p,
+        size_t threshold, unsigned long timeout_us) {
+    if (threshold > p->size) {
+        threshold = p->size;
+    }
+
+    p->threshold = threshold;
+    STORE(p->looptask, xTaskGetCurrentTaskHandle());
+    uaio_waitqueue_push(&p->readers, task);
+    if (timeout_us) {
+        uaio_task_sleep(task, timeout_us);
+        return;
+    }
+
+    task->status = UAIO_WAITING;
+}
+
+
+/* Returns -1 if the reader is woken up by its timer */
+int
+uaio_pipe_waitend(struct uaio_task *task) {
+    if (uaio_waitqueue_remove(task) == 0) {
+        return -1;
+    }
+
+    uaio_task_sleep_cancel(task);
+    return 0;
+}
+
+
+/* Wakes up the readers of the pipes that reached the threshold, called by
+ * the loop on each iteration. Returns the number of woken up readers. */
+int
+uaio_pipe_tick() {
+    struct uaio_pipe *p;
+    int woken = 0;
+
+    for (p = _pipes; p; p = p->next) {
+        STORE(p->signaled, false);
+        if (p->readers.head &&
+                (uaio_pipe_available(p) >= p->threshold)) {
+            uaio_waitqueue_wakeup(&p->readers);
+            woken++;
+        }
+    }
+
+    return woken;
+}
@@ -1,55 +1,246 @@
-#include <time.h>
 #include <errno.h>
+#include <string.h>
 
 #include <elog.h>
 
 #include "uaio.h"
 #include "select.h"
+#include "simtime.h"
 
 
-#define TSEMPTY(ts) (!((ts).tv_sec || (ts).tv_nsec))
+/* Both newlib and glibc store fd_set as an array of unsigned long words,
+ * bit n % WORDBITS of the word n / WORDBITS is the file n. */
+#define FDSET_WORDBITS (sizeof(unsigned long) * 8)
+#define FDSET_WORDS(s) ((s)->maxfileno / FDSET_WORDBITS + 1)
+#define FDSET_WORD(set, i) (((unsigned long *)(set))[i])
 
 
-static long
-timediff(struct timespec start, struct timespec end) {
-    long sec;
-    long nsec;
+static const int _direvents[UAIO_FILEDIRS] = {UAIO_IN, UAIO_OUT, UAIO_ERR};
 
-    if ((end.tv_nsec - start.tv_nsec) < 0) {
-        sec = end.tv_sec - start.tv_sec - 1;
-        nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
+
+static fd_set *
+_dirset(struct uaio_select *s, int dir) {
+    switch (dir) {
+        case UAIO_FILEDIR_IN:
+            return &s->rfds;
+        case UAIO_FILEDIR_OUT:
+            return &s->wfds;
     }
-    else {
-        sec = end.tv_sec - start.tv_sec;
-        nsec = end.tv_nsec - start.tv_nsec;
+    return &s->efds;
+}
+
+
+static void
+_slot_clear(struct uaio_select *s, int fd, int dir) {
+    struct uaio_fileslot *slot = &s->events[fd].slots[dir];
+
+    FD_CLR(fd, _dirset(s, dir));
+    s->waitingfiles--;
+    slot->task = NULL;
+}
+
+
+/* Drop every slot the task holds on the file */
+static void
+_release(struct uaio_select *s, int fd, struct uaio_task *task) {
+    int dir;
+
+    for (dir = 0; dir < UAIO_FILEDIRS; dir++) {
+        if (s->events[fd].slots[dir].task == task) {
+            _slot_clear(s, fd, dir);
+        }
     }
-    return (sec * 1000000) + (nsec / 1000);
 }
 
 
-static long
-_select_task_timeout_us(struct uaio_task *task) {
-    struct timespec now;
-    long diff_us;
+/* The readiness wins over the timeout timer of the file wait, if any */
+static void
+_wake(struct uaio_select *s, int fd, struct uaio_task *task) {
+    if (task->status == UAIO_WAITING) {
+        task->status = UAIO_RUNNING;
+        uaio_task_sleep_cancel(task);
+    }
+    _release(s, fd, task);
+}
 
-    if (TSEMPTY(task->select_timestamp)) {
-        return 0;
+
+int
+uaio_select_init(struct uaio_select *s, unsigned int maxfileno) {
+    if (maxfileno >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(s, 0, sizeof(struct uaio_select));
+    s->maxfileno = maxfileno;
+    s->events = uaio_calloc(UAIO_MEM_EVENTS, maxfileno + 1,
+            sizeof(struct uaio_fileevent));
+    if (s->events == NULL) {
+        return -1;
+    }
+
+    FD_ZERO(&s->rfds);
+    FD_ZERO(&s->wfds);
+    FD_ZERO(&s->efds);
+    return 0;
+}
+
+
+int
+uaio_select_deinit(struct uaio_select *s) {
+    if (s->events == NULL) {
+        return -1;
+    }
+
+    uaio_free(UAIO_MEM_EVENTS, s->events);
+    s->events = NULL;
+    return 0;
+}
+
+
+int
+uaio_select_monitor(struct uaio_select *s, struct uaio_task *task, int fd,
+        int events) {
+    int dir;
+    struct uaio_fileslot *slot;
+
+    if ((fd < 0) || (fd > s->maxfileno)) {
+        return -1;
+    }
+
+    /* Each direction may be awaited by a different task */
+    for (dir = 0; dir < UAIO_FILEDIRS; dir++) {
+        slot = &s->events[fd].slots[dir];
+        if ((events & _direvents[dir]) && slot->task &&
+                (slot->task != task)) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    _release(s, fd, task);
+
+    for (dir = 0; dir < UAIO_FILEDIRS; dir++) {
+        if (!(events & _direvents[dir])) {
+            continue;
+        }
+
+        slot = &s->events[fd].slots[dir];
+        slot->task = task;
+        s->waitingfiles++;
+        FD_SET(fd, _dirset(s, dir));
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    diff_us = timediff(task->select_timestamp, now);
-    return task->select_timeout_us - diff_us;
+    return 0;
+}
+
+
+int
+uaio_select_forget(struct uaio_select *s, int fd) {
+    int dir;
+    int ret = -1;
+
+    if ((fd < 0) || (fd > s->maxfileno)) {
+        return -1;
+    }
+
+    for (dir = 0; dir < UAIO_FILEDIRS; dir++) {
+        if (s->events[fd].slots[dir].task) {
+            _slot_clear(s, fd, dir);
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+
+/* Finds the first file the task waits for, returns the file descriptor
+ * and stores the awaited events, or -1 if the task waits for no file */
+int
+uaio_select_task(struct uaio_select *s, struct uaio_task *task,
+        int *events) {
+    int fd;
+    int dir;
+
+    *events = 0;
+    for (fd = 0; s->waitingfiles && (fd <= s->maxfileno); fd++) {
+        for (dir = 0; dir < UAIO_FILEDIRS; dir++) {
+            if (s->events[fd].slots[dir].task == task) {
+                *events |= _direvents[dir];
+            }
+        }
+
+        if (*events) {
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Drops the slots of a task that stops waiting for any other reason than
+ * the readiness, e.g. the timeout. */
+void
+uaio_select_forget_task(struct uaio_select *s, struct uaio_task *task) {
+    int fd;
+
+    for (fd = 0; s->waitingfiles && (fd <= s->maxfileno); fd++) {
+        _release(s, fd, task);
+    }
+}
+
+
+/* Exports the monitored files and the awaited events, returns the number
+ * of entries written. */
+int
+uaio_select_interest(struct uaio_select *s, struct uaio_fileinterest *out,
+        size_t size) {
+    int fd;
+    size_t i;
+    size_t count = 0;
+    unsigned long bits;
+
+    for (i = 0; i < FDSET_WORDS(s); i++) {
+        bits = FDSET_WORD(&s->rfds, i) | FDSET_WORD(&s->wfds, i) |
+            FDSET_WORD(&s->efds, i);
+
+        while (bits && (count < size)) {
+            fd = i * FDSET_WORDBITS + __builtin_ctzl(bits);
+            bits &= bits - 1;
+
+            out[count].fd = fd;
+            out[count].events = 0;
+            if (FD_ISSET(fd, &s->rfds)) {
+                out[count].events |= UAIO_IN;
+            }
+
+            if (FD_ISSET(fd, &s->wfds)) {
+                out[count].events |= UAIO_OUT;
+            }
+
+            if (FD_ISSET(fd, &s->efds)) {
+                out[count].events |= UAIO_ERR;
+            }
+            count++;
+        }
+    }
+
+    return count;
 }
 
 
 int
 uaio_select_tick(struct uaio_select *s, unsigned int timeout_us) {
-    int i;
     int fd;
     int nfds;
-    int shift;
-    struct uaio_fileevent *fe;
+    size_t i;
+    unsigned long bits;
+    struct uaio_fileslot *slots;
+#ifndef CONFIG_UAIO_SIMTIME
     struct timeval tv;
+#endif
     fd_set rfds;
     fd_set wfds;
     fd_set efds;
@@ -58,81 +249,48 @@ uaio_select_tick(struct uaio_select *s, unsigned int timeout_us) {
         return 0;
     }
 
+#ifndef CONFIG_UAIO_SIMTIME
     tv.tv_usec = timeout_us % 1000000;
     tv.tv_sec = timeout_us / 1000000;
+#endif
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    for (i = 0; i < s->eventscount; i++) {
-        fe = &s->events[i];
-        fd = fe->fd;
-
-        if (fe->events == 0) {
-            s->waitingfiles--;
-            continue;
-        }
-
-        if (fe->events & UAIO_IN) {
-            FD_SET(fd, &rfds);
-        }
-
-        if (fe->events & UAIO_OUT) {
-            FD_SET(fd, &wfds);
-        }
-
-        if (fe->events & UAIO_ERR) {
-            FD_SET(fd, &efds);
-        }
-    }
+    memcpy(&rfds, &s->rfds, sizeof(fd_set));
+    memcpy(&wfds, &s->wfds, sizeof(fd_set));
+    memcpy(&efds, &s->efds, sizeof(fd_set));
 
     errno = 0;
+#ifdef CONFIG_UAIO_SIMTIME
+    nfds = uaio_simtime_select(s->maxfileno + 1, &rfds, &wfds, &efds);
+#else
     nfds = select(s->maxfileno + 1, &rfds, &wfds, &efds, &tv);
+#endif
     if (nfds == -1) {
         return -1;
     }
 
-    // if (nfds == 0) {
-    //     return 0;
-    // }
-
-    shift = 0;
-    int ttout;
-    for (i = 0; i < s->eventscount; i++) {
-        fe = &s->events[i];
-        fd = fe->fd;
-
-        if ((fd == -1)
-                || FD_ISSET(fd, &rfds)
-                || FD_ISSET(fd, &wfds)
-                || FD_ISSET(fd, &efds)) {
-            if (fe->task && (fe->task->status == UAIO_WAITING)) {
-                fe->task->status = UAIO_RUNNING;
-                s->waitingfiles--;
-                FILEEVENT_RESET(fe);
+    /* Visit only the ready files, wake each direction's own waiter */
+    for (i = 0; nfds && (i < FDSET_WORDS(s)); i++) {
+        bits = FDSET_WORD(&rfds, i) | FDSET_WORD(&wfds, i) |
+            FDSET_WORD(&efds, i);
+
+        while (bits) {
+            fd = i * FDSET_WORDBITS + __builtin_ctzl(bits);
+            bits &= bits - 1;
+
+            slots = s->events[fd].slots;
+            if (FD_ISSET(fd, &rfds) && slots[UAIO_FILEDIR_IN].task) {
+                _wake(s, fd, slots[UAIO_FILEDIR_IN].task);
             }
-            shift++;
-            continue;
-        }
 
-        if ((fe->task->status == UAIO_WAITING) &&
-            ((ttout = _select_task_timeout_us(fe->task)) < 0)) {
-            fe->task->status = UAIO_RUNNING;
-            fe->task->select_timeout_us = ttout;
-            s->waitingfiles--;
-            FILEEVENT_RESET(fe);
-            shift++;
-            continue;
-        }
+            if (FD_ISSET(fd, &wfds) && slots[UAIO_FILEDIR_OUT].task) {
+                _wake(s, fd, slots[UAIO_FILEDIR_OUT].task);
+            }
 
-        if (!shift) {
-            continue;
+            if (FD_ISSET(fd, &efds) && slots[UAIO_FILEDIR_ERR].task) {
+                _wake(s, fd, slots[UAIO_FILEDIR_ERR].task);
+            }
         }
-
-        s->events[i - shift] = *fe;
-        FILEEVENT_RESET(fe);
     }
-    s->eventscount = s->waitingfiles;
 
     return 0;
 }
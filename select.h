@@ -3,31 +3,81 @@
 
 
 #include <stddef.h>
+#include <sys/select.h>
 
 #include "uaio.h"
 
 
-#define FILEEVENT_RESET(fe) \
-            (fe)->task = NULL; \
-            (fe)->fd = -1; \
-            (fe)->events = 0
+/* Waiter slots of a file, one per direction */
+enum uaio_filedirection {
+    UAIO_FILEDIR_IN,
+    UAIO_FILEDIR_OUT,
+    UAIO_FILEDIR_ERR,
+    UAIO_FILEDIRS
+};
 
 
-struct uaio_fileevent {
-    int fd;
-    int events;
+/* Declared by uaio.h only when CONFIG_UAIO_SELECT is enabled */
+struct uaio_fileinterest;
+
+
+struct uaio_fileslot {
     struct uaio_task *task;
 };
 
 
+struct uaio_fileevent {
+    struct uaio_fileslot slots[UAIO_FILEDIRS];
+};
+
+
 struct uaio_select {
     unsigned int maxfileno;
+
+    /* occupied waiter slots */
     size_t waitingfiles;
+
+    /* indexed by the file descriptor */
     struct uaio_fileevent *events;
-    size_t eventscount;
+
+    /* maintained by monitor/forget and copied before each select(2) */
+    fd_set rfds;
+    fd_set wfds;
+    fd_set efds;
 };
 
 
+int
+uaio_select_init(struct uaio_select *s, unsigned int maxfileno);
+
+
+int
+uaio_select_deinit(struct uaio_select *s);
+
+
+int
+uaio_select_monitor(struct uaio_select *s, struct uaio_task *task, int fd,
+        int events);
+
+
+int
+uaio_select_forget(struct uaio_select *s, int fd);
+
+
+void
+uaio_select_forget_task(struct uaio_select *s, struct uaio_task *task);
+
+
+int
+uaio_select_task(struct uaio_select *s, struct uaio_task *task,
+        int *events);
+
+
+int
+uaio_select_interest(struct uaio_select *s, struct uaio_fileinterest *out,
+        size_t size);
+
+
 int
 uaio_select_tick(struct uaio_select *s, unsigned int timeout_us);
 
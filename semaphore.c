@@ -28,6 +28,7 @@ uaio_semaphore_begin(struct uaio_task *task, struct uaio_semaphore *s) {
     task->semaphore = s;
     s->value = 0;
     s->task = task;
+    s->frame = task->current;
     return 0;
 }
 
@@ -26,6 +26,9 @@
 typedef struct uaio_semaphore {
     volatile int value;
     struct uaio_task *task;
+
+    /* the frame of the task the semaphore lives in */
+    struct uaio_basecall *frame;
 } uaio_semaphore_t;
 
 
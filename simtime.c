@@ -0,0 +1,131 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <errno.h>
+
+#include "uaio.h"
+#include "simtime.h"
+
+
+/* The virtual clock starts at one second, so the deadlines are never
+ * zero. */
+#define SIMTIME_EPOCH_US 1000000ULL
+
+
+static unsigned long long _now_us = SIMTIME_EPOCH_US;
+static uaio_simbackend_t _backend = NULL;
+
+
+void
+uaio_simtime_reset() {
+    _now_us = SIMTIME_EPOCH_US;
+    _backend = NULL;
+}
+
+
+unsigned long long
+uaio_simtime_now() {
+    return _now_us;
+}
+
+
+void
+uaio_simtime_backend(uaio_simbackend_t backend) {
+    _backend = backend;
+}
+
+
+int
+uaio_simtime_gettime(struct timespec *ts) {
+    if (ts == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ts->tv_sec = _now_us / 1000000;
+    ts->tv_nsec = (_now_us % 1000000) * 1000;
+    return 0;
+}
+
+
+/* Called by the loop whenever it would block, moves the virtual clock by
+ * the amount of time the real loop would block, which is bounded by the
+ * next deadline of the timer heap. */
+void
+uaio_simtime_advance(unsigned long us) {
+    _now_us += us;
+}
+
+
+#ifdef CONFIG_UAIO_SELECT
+
+
+/* Drop-in replacement of select(2), asks the scripted backend about the
+ * readiness of each requested file at the current virtual time. */
+int
+uaio_simtime_select(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds) {
+    int fd;
+    int events;
+    int ready;
+    int count = 0;
+
+    for (fd = 0; fd < nfds; fd++) {
+        events = 0;
+        if (FD_ISSET(fd, rfds)) {
+            events |= UAIO_IN;
+        }
+
+        if (FD_ISSET(fd, wfds)) {
+            events |= UAIO_OUT;
+        }
+
+        if (FD_ISSET(fd, efds)) {
+            events |= UAIO_ERR;
+        }
+
+        if (events == 0) {
+            continue;
+        }
+
+        ready = 0;
+        if (_backend) {
+            ready = _backend(fd, events, _now_us) & events;
+        }
+
+        if (!(ready & UAIO_IN)) {
+            FD_CLR(fd, rfds);
+        }
+
+        if (!(ready & UAIO_OUT)) {
+            FD_CLR(fd, wfds);
+        }
+
+        if (!(ready & UAIO_ERR)) {
+            FD_CLR(fd, efds);
+        }
+
+        if (ready) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+#endif  // CONFIG_UAIO_SELECT
@@ -0,0 +1,68 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifndef SIMTIME_H_
+#define SIMTIME_H_
+
+
+#include <time.h>
+
+#include "uaio.h"
+
+
+#ifdef CONFIG_UAIO_SIMTIME
+
+
+#include <sys/select.h>
+
+
+#define UAIO_GETTIME(ts) uaio_simtime_gettime(ts)
+
+
+void
+uaio_simtime_reset();
+
+
+int
+uaio_simtime_gettime(struct timespec *ts);
+
+
+void
+uaio_simtime_advance(unsigned long us);
+
+
+#ifdef CONFIG_UAIO_SELECT
+
+
+int
+uaio_simtime_select(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds);
+
+
+#endif  // CONFIG_UAIO_SELECT
+
+
+#else
+
+
+#define UAIO_GETTIME(ts) clock_gettime(CLOCK_MONOTONIC, ts)
+
+
+#endif  // CONFIG_UAIO_SIMTIME
+
+
+#endif  // SIMTIME_H_
@@ -0,0 +1,236 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "uaio.h"
+
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+#define ACCEPT_EXHAUSTED(e) \
+    (((e) == EMFILE) || ((e) == ENFILE) || ((e) == ENOBUFS) || \
+     ((e) == ENOMEM))
+
+
+int
+uaio_socket_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+int
+uaio_socket_listen(const struct sockaddr *addr, socklen_t addrlen,
+        int backlog) {
+    int fd;
+    int option = 1;
+
+    fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option))) {
+        goto failure;
+    }
+
+    if (bind(fd, addr, addrlen)) {
+        goto failure;
+    }
+
+    if (listen(fd, backlog)) {
+        goto failure;
+    }
+
+    if (uaio_socket_nonblock(fd)) {
+        goto failure;
+    }
+
+    return fd;
+
+failure:
+    close(fd);
+    return -1;
+}
+
+
+/* The socket must be non-blocking, -1 with EINPROGRESS means the caller
+ * has to wait for the socket to be writable and call
+ * uaio_socket_connectend() */
+int
+uaio_socket_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (connect(fd, addr, addrlen) == 0) {
+        return 0;
+    }
+
+    /* Already in progress by a previous call */
+    if (errno == EALREADY) {
+        errno = EINPROGRESS;
+    }
+
+    return -1;
+}
+
+
+/* Reports the outcome of a pending connect in errno */
+int
+uaio_socket_connectend(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        return -1;
+    }
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* A peer that went away must not kill the process by SIGPIPE */
+ssize_t
+uaio_socket_send(int fd, const void *buf, size_t size) {
+    return send(fd, buf, size, MSG_NOSIGNAL);
+}
+
+
+int
+uaio_acceptor_init(struct uaio_acceptor *a, int fd, size_t batch,
+        uaio_accept_t accepted, void *arg) {
+    if ((a == NULL) || (fd < 0) || (accepted == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    a->fd = fd;
+    a->batch = batch;
+    a->accepted = accepted;
+    a->arg = arg;
+    a->connections = 0;
+    a->batches = 0;
+    a->dropped = 0;
+    a->exhausted = 0;
+    return 0;
+}
+
+
+static int
+_accept(int listenfd) {
+#ifdef __linux__
+    return accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+#else
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (uaio_socket_nonblock(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+#endif
+}
+
+
+/* Accepts until the backlog is empty or the batch is full, so a single
+ * readiness serves a whole burst of connections. Connections the callback
+ * refuses are closed and counted as dropped. Returns the number of
+ * accepted connections, or -1 with EAGAIN if there was none, or EMFILE
+ * or ENFILE if there is no file descriptor left to accept into. */
+int
+uaio_acceptor_drain(struct uaio_acceptor *a) {
+    int fd;
+    int count = 0;
+
+    while ((a->batch == 0) || (count < a->batch)) {
+        fd = _accept(a->fd);
+        if (fd == -1) {
+            /* The peer gave up while waiting in the backlog */
+            if ((errno == ECONNABORTED) || (errno == EINTR)) {
+                continue;
+            }
+
+            if (ACCEPT_EXHAUSTED(errno)) {
+                a->exhausted++;
+            }
+
+            /* Report the error, if any, by the next call */
+            if (count) {
+                break;
+            }
+
+            return -1;
+        }
+
+        count++;
+        a->connections++;
+        if (a->accepted(fd, a->arg)) {
+            a->dropped++;
+            close(fd);
+        }
+    }
+
+    a->batches++;
+    errno = 0;
+    return count;
+}
+
+
+/* Parks the task after a failed drain, until the listener is readable, or
+ * for a while if out of file descriptors. The listener stays readable then,
+ * so waiting for it would spin. */
+int
+uaio_acceptor_wait(struct uaio_task *task, struct uaio_acceptor *a) {
+    if (ACCEPT_EXHAUSTED(errno)) {
+        uaio_task_sleep(task, CONFIG_UAIO_SOCKET_ACCEPT_BACKOFF_US);
+        return 0;
+    }
+
+    if (!UAIO_MUSTWAIT(errno)) {
+        return -1;
+    }
+
+    if (uaio_file_monitor(task, a->fd, UAIO_IN, 0)) {
+        return -1;
+    }
+
+    task->status = UAIO_WAITING;
+    return 0;
+}
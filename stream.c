@@ -0,0 +1,365 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uaio.h"
+
+
+#define BUFF_TAIL(b) (((b)->head + (b)->len) % (b)->size)
+#define BUFF_FREE(b) ((b)->size - (b)->len)
+#define BUFF_ISFULL(b) ((b)->len == (b)->size)
+
+
+/* Contiguous free space after the tail */
+static size_t
+_buff_freechunk(struct uaio_streambuff *b) {
+    size_t tail = BUFF_TAIL(b);
+
+    if (BUFF_ISFULL(b)) {
+        return 0;
+    }
+
+    if (tail >= b->head) {
+        return b->size - tail;
+    }
+
+    return b->head - tail;
+}
+
+
+/* Contiguous used space after the head */
+static size_t
+_buff_usedchunk(struct uaio_streambuff *b) {
+    if ((b->head + b->len) > b->size) {
+        return b->size - b->head;
+    }
+
+    return b->len;
+}
+
+
+static void
+_buff_skip(struct uaio_streambuff *b, size_t count) {
+    b->head = (b->head + count) % b->size;
+    b->len -= count;
+    if (b->len == 0) {
+        b->head = 0;
+    }
+}
+
+
+static size_t
+_buff_get(struct uaio_streambuff *b, char *buf, size_t count) {
+    size_t chunk;
+
+    if (count > b->len) {
+        count = b->len;
+    }
+
+    chunk = _buff_usedchunk(b);
+    if (chunk >= count) {
+        memcpy(buf, b->data + b->head, count);
+    }
+    else {
+        memcpy(buf, b->data + b->head, chunk);
+        memcpy(buf + chunk, b->data, count - chunk);
+    }
+
+    _buff_skip(b, count);
+    return count;
+}
+
+
+static size_t
+_buff_put(struct uaio_streambuff *b, const char *buf, size_t count) {
+    size_t chunk;
+    size_t total = 0;
+
+    if (count > BUFF_FREE(b)) {
+        count = BUFF_FREE(b);
+    }
+
+    while (total < count) {
+        chunk = _buff_freechunk(b);
+        if (chunk > (count - total)) {
+            chunk = count - total;
+        }
+        memcpy(b->data + BUFF_TAIL(b), buf + total, chunk);
+        b->len += chunk;
+        total += chunk;
+    }
+
+    return total;
+}
+
+
+/* Reads as much as possible into the read buffer. A short read means the
+ * file is drained, so it stops there instead of spending another syscall
+ * just to get EAGAIN. Returns the number of bytes read, zero on EOF and -1
+ * on error. */
+static ssize_t
+_fill(struct uaio_stream *s) {
+    struct uaio_streambuff *b = &s->rbuff;
+    size_t chunk;
+    ssize_t bytes;
+    ssize_t total = 0;
+
+    while ((chunk = _buff_freechunk(b))) {
+        bytes = read(s->fd, b->data + BUFF_TAIL(b), chunk);
+        if (bytes <= 0) {
+            if (total) {
+                errno = 0;
+                return total;
+            }
+            return bytes;
+        }
+
+        b->len += bytes;
+        total += bytes;
+        if (bytes < chunk) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+int
+uaio_stream_init(struct uaio_stream *s, int fd, size_t rsize,
+        size_t wsize) {
+    if ((s == NULL) || (fd < 0) || (rsize < 1) || (wsize < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(s, 0, sizeof(struct uaio_stream));
+    s->fd = fd;
+    s->rbuff.data = uaio_malloc(UAIO_MEM_BUFFER, rsize);
+    if (s->rbuff.data == NULL) {
+        return -1;
+    }
+    s->rbuff.size = rsize;
+
+    s->wbuff.data = uaio_malloc(UAIO_MEM_BUFFER, wsize);
+    if (s->wbuff.data == NULL) {
+        uaio_free(UAIO_MEM_BUFFER, s->rbuff.data);
+        s->rbuff.data = NULL;
+        return -1;
+    }
+    s->wbuff.size = wsize;
+    return 0;
+}
+
+
+int
+uaio_stream_deinit(struct uaio_stream *s) {
+    if (s == NULL) {
+        return -1;
+    }
+
+    if (s->rbuff.data) {
+        uaio_free(UAIO_MEM_BUFFER, s->rbuff.data);
+        s->rbuff.data = NULL;
+    }
+
+    if (s->wbuff.data) {
+        uaio_free(UAIO_MEM_BUFFER, s->wbuff.data);
+        s->wbuff.data = NULL;
+    }
+
+    return 0;
+}
+
+
+ssize_t
+uaio_stream_readsome(struct uaio_stream *s, char *buf, size_t size) {
+    struct uaio_streambuff *b = &s->rbuff;
+    ssize_t bytes;
+
+    if (b->len == 0) {
+        /* Large reads bypass the buffer */
+        if (size >= b->size) {
+            return read(s->fd, buf, size);
+        }
+
+        bytes = _fill(s);
+        if (bytes <= 0) {
+            return bytes;
+        }
+    }
+
+    bytes = _buff_get(b, buf, size);
+    s->scanned = 0;
+    return bytes;
+}
+
+
+ssize_t
+uaio_stream_readexactly(struct uaio_stream *s, char *buf, size_t size) {
+    struct uaio_streambuff *b = &s->rbuff;
+    ssize_t bytes;
+
+    if (size > b->size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (b->len < size) {
+        bytes = _fill(s);
+        if ((bytes == 0) && b->len) {
+            /* Truncated, the partial data is left in the buffer */
+            errno = ENODATA;
+            return -1;
+        }
+
+        if (bytes <= 0) {
+            return bytes;
+        }
+
+        if (b->len < size) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    bytes = _buff_get(b, buf, size);
+    s->scanned = 0;
+    return bytes;
+}
+
+
+ssize_t
+uaio_stream_readuntil(struct uaio_stream *s, char *buf, size_t size,
+        char delim) {
+    struct uaio_streambuff *b = &s->rbuff;
+    bool filled = false;
+    ssize_t bytes;
+    size_t i;
+
+    for (;;) {
+        /* Continue searching where the previous attempt left */
+        for (i = s->scanned; i < b->len; i++) {
+            if (b->data[(b->head + i) % b->size] != delim) {
+                continue;
+            }
+
+            if ((i + 1) > size) {
+                errno = ENOBUFS;
+                return -1;
+            }
+
+            bytes = _buff_get(b, buf, i + 1);
+            s->scanned = 0;
+            return bytes;
+        }
+        s->scanned = b->len;
+
+        if (BUFF_ISFULL(b)) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        if (filled) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        bytes = _fill(s);
+        if ((bytes == 0) && b->len) {
+            errno = ENODATA;
+            return -1;
+        }
+
+        if (bytes <= 0) {
+            return bytes;
+        }
+        filled = true;
+    }
+}
+
+
+int
+uaio_stream_flush(struct uaio_stream *s) {
+    struct uaio_streambuff *b = &s->wbuff;
+    size_t chunk;
+    ssize_t bytes;
+
+    while (b->len) {
+        chunk = _buff_usedchunk(b);
+        bytes = write(s->fd, b->data + b->head, chunk);
+        if (bytes < 0) {
+            return -1;
+        }
+
+        _buff_skip(b, bytes);
+        if (bytes < chunk) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+ssize_t
+uaio_stream_writeall(struct uaio_stream *s, const char *buf, size_t size) {
+    struct uaio_streambuff *b = &s->wbuff;
+    ssize_t bytes;
+
+    while (s->written < size) {
+        /* Large writes bypass the buffer when it's empty */
+        if ((b->len == 0) && ((size - s->written) >= b->size)) {
+            bytes = write(s->fd, buf + s->written, size - s->written);
+            if (bytes < 0) {
+                goto failed;
+            }
+
+            s->written += bytes;
+            if (s->written < size) {
+                errno = EAGAIN;
+                goto failed;
+            }
+            continue;
+        }
+
+        s->written += _buff_put(b, buf + s->written, size - s->written);
+        if (s->written == size) {
+            break;
+        }
+
+        if (uaio_stream_flush(s)) {
+            goto failed;
+        }
+    }
+
+    s->written = 0;
+    return size;
+
+failed:
+    if (!UAIO_MUSTWAIT(errno)) {
+        s->written = 0;
+    }
+    return -1;
+}
@@ -0,0 +1,107 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stdio.h>
+
+#include "uaio.h"
+
+
+static const char *
+_statusname(enum uaio_taskstatus status) {
+    switch (status) {
+        case UAIO_IDLE:
+            return "idle";
+        case UAIO_RUNNING:
+            return "running";
+        case UAIO_WAITING:
+            return "waiting";
+        case UAIO_TERMINATING:
+            return "terminating";
+        case UAIO_TERMINATED:
+            return "terminated";
+    }
+
+    return "unknown";
+}
+
+
+/* Negative when the timer is overdue */
+static long
+_remaining(uaio_time_t t, uaio_time_t now) {
+    if (UAIO_TIME_BEFORE(t, now)) {
+        return -(long)(now - t);
+    }
+
+    return t - now;
+}
+
+
+/* Coroutines are printed as addresses, the idf.py monitor decodes them into
+ * symbols like it does for backtraces. */
+int
+uaio_task_dump(FILE *out) {
+    struct uaio_task *task = NULL;
+    struct uaio_taskinfo info;
+    uaio_time_t now = uaio_now();
+    size_t i;
+    int count = 0;
+
+    while ((task = uaio_task_walk(task))) {
+        if (uaio_task_info(task, &info)) {
+            continue;
+        }
+
+        fprintf(out, "task %p %s for %luus eno %d", task,
+                _statusname(info.status), info.elapsed_us, info.eno);
+        if (info.fd != -1) {
+            fprintf(out, " fd %d events 0x%x", info.fd, info.events);
+        }
+
+        if (info.sleeping) {
+            fprintf(out, " sleep %ldus", _remaining(info.sleep, now));
+        }
+
+        if (info.deadlined) {
+            fprintf(out, " deadline %ldus", _remaining(info.deadline, now));
+        }
+
+        if (info.waitqueue) {
+            fprintf(out, " queue %p", info.waitqueue);
+        }
+
+#ifdef CONFIG_UAIO_SEMAPHORE
+        if (info.semaphore) {
+            fprintf(out, " semaphore %p", info.semaphore);
+        }
+#endif
+        fprintf(out, "\n");
+
+        for (i = 0; (i < info.depth) && (i < UAIO_TASKINFO_MAXFRAMES); i++) {
+            fprintf(out, "    #%u %p line %d\n", (unsigned int)i,
+                    (void *)info.frames[i].coro, info.frames[i].line);
+        }
+
+        if (info.depth > UAIO_TASKINFO_MAXFRAMES) {
+            fprintf(out, "    ... %u more frames\n",
+                    (unsigned int)(info.depth - UAIO_TASKINFO_MAXFRAMES));
+        }
+        count++;
+    }
+
+    return count;
+}
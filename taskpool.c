@@ -95,7 +95,8 @@ uaio_taskpool_init(struct uaio_taskpool *pool, size_t size) {
         return -1;
     }
 
-    pool->tasks = calloc(size, sizeof(struct uaio_task));
+    pool->tasks = uaio_calloc(UAIO_MEM_TASKPOOL, size,
+            sizeof(struct uaio_task));
     if (pool->tasks == NULL) {
         return -1;
     }
@@ -120,7 +121,7 @@ uaio_taskpool_deinit(struct uaio_taskpool *pool) {
     }
 
     if (pool->tasks != NULL) {
-        free(pool->tasks);
+        uaio_free(UAIO_MEM_TASKPOOL, pool->tasks);
     }
 
     return 0;
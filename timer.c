@@ -0,0 +1,258 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timer.h"
+#include "simtime.h"
+
+
+#define PARENT(i) ((i) / 2)
+#define LEFT(i) ((i) * 2)
+#define BEFORE(t, a, b) \
+    UAIO_TIME_BEFORE((t)->heap[a]->deadline, (t)->heap[b]->deadline)
+
+
+/* Positions are one based */
+#ifdef CONFIG_UAIO_COMPACT
+#define TIMERS_MAX (UINT16_MAX - 1)
+#else
+#define TIMERS_MAX (SIZE_MAX - 1)
+#endif
+
+
+static void
+_swap(struct uaio_timers *t, size_t a, size_t b) {
+    struct uaio_timer *tmp = t->heap[a];
+
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->heap[a]->index = a;
+    t->heap[b]->index = b;
+}
+
+
+static void
+_siftup(struct uaio_timers *t, size_t i) {
+    while ((i > 1) && BEFORE(t, i, PARENT(i))) {
+        _swap(t, i, PARENT(i));
+        i = PARENT(i);
+    }
+}
+
+
+static void
+_siftdown(struct uaio_timers *t, size_t i) {
+    size_t child;
+
+    while ((child = LEFT(i)) <= t->count) {
+        if ((child < t->count) && BEFORE(t, child + 1, child)) {
+            child++;
+        }
+
+        if (!BEFORE(t, child, i)) {
+            break;
+        }
+
+        _swap(t, i, child);
+        i = child;
+    }
+}
+
+
+/* The latest moment the timers of the subtree allow the loop to sleep
+ * until. The subtree is skipped as soon as its earliest deadline can't
+ * beat the best one found so far. */
+static uaio_time_t
+_latest(struct uaio_timers *t, size_t i, uaio_time_t best) {
+    struct uaio_timer *timer;
+    uaio_time_t latest;
+
+    if (i > t->count) {
+        return best;
+    }
+
+    timer = t->heap[i];
+    if (!UAIO_TIME_BEFORE(timer->deadline, best)) {
+        return best;
+    }
+
+    latest = timer->deadline + timer->slack;
+    if (UAIO_TIME_BEFORE(latest, best)) {
+        best = latest;
+    }
+
+    best = _latest(t, LEFT(i), best);
+    return _latest(t, LEFT(i) + 1, best);
+}
+
+
+int
+uaio_timers_init(struct uaio_timers *t, size_t size) {
+    memset(t, 0, sizeof(struct uaio_timers));
+    if (size > TIMERS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    t->heap = uaio_calloc(UAIO_MEM_EVENTS, size + 1,
+            sizeof(struct uaio_timer *));
+    if (t->heap == NULL) {
+        return -1;
+    }
+
+    t->size = size;
+    return 0;
+}
+
+
+int
+uaio_timers_deinit(struct uaio_timers *t) {
+    if (t->heap == NULL) {
+        return -1;
+    }
+
+    uaio_free(UAIO_MEM_EVENTS, t->heap);
+    t->heap = NULL;
+    return 0;
+}
+
+
+uaio_time_t
+uaio_timers_now() {
+    struct timespec ts;
+
+    UAIO_GETTIME(&ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+struct uaio_task *
+uaio_timer_task(struct uaio_timer *timer) {
+    if (timer->expiry == UAIO_TIMER_DEADLINE) {
+        return (struct uaio_task *)
+            ((char *)timer - offsetof(struct uaio_task, deadline));
+    }
+
+    return (struct uaio_task *)
+        ((char *)timer - offsetof(struct uaio_task, sleep));
+}
+
+
+/* The slack of a compact timer is limited to UAIO_TIME_MAXSPAN */
+int
+uaio_timer_arm(struct uaio_timers *t, struct uaio_timer *timer,
+        uaio_time_t deadline, unsigned long slack, int expiry) {
+    if (timer->index) {
+        uaio_timer_disarm(t, timer);
+    }
+
+    if (t->count == t->size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    timer->expiry = expiry;
+    timer->deadline = deadline;
+    timer->slack = slack;
+    timer->index = ++t->count;
+    t->heap[timer->index] = timer;
+    _siftup(t, timer->index);
+    t->stats.armed++;
+    return 0;
+}
+
+
+void
+uaio_timer_disarm(struct uaio_timers *t, struct uaio_timer *timer) {
+    size_t i = timer->index;
+
+    if (i == 0) {
+        return;
+    }
+
+    timer->index = 0;
+    if (i == t->count--) {
+        return;
+    }
+
+    t->heap[i] = t->heap[t->count + 1];
+    t->heap[i]->index = i;
+    _siftup(t, i);
+    _siftdown(t, t->heap[i]->index);
+}
+
+
+/* Microseconds the loop may block for, the earliest deadline plus its
+ * slack, but no longer than maxus */
+unsigned long
+uaio_timers_next(struct uaio_timers *t, uaio_time_t now,
+        unsigned long maxus) {
+    struct uaio_timer *root;
+    uaio_time_t latest;
+
+    if (t->count == 0) {
+        return maxus;
+    }
+
+    root = t->heap[1];
+    latest = _latest(t, 1, root->deadline + root->slack + 1);
+    if (!UAIO_TIME_BEFORE(now, latest)) {
+        return 0;
+    }
+
+    if ((latest - now) < maxus) {
+        return latest - now;
+    }
+
+    return maxus;
+}
+
+
+/* Wakes up the owners of every due timer in a single pass, the timers that
+ * shared the wakeup with the first one are counted as saved wakeups. */
+int
+uaio_timers_expire(struct uaio_timers *t, uaio_time_t now) {
+    struct uaio_timer *timer;
+    struct uaio_task *task;
+    int fired = 0;
+
+    while (t->count && !UAIO_TIME_BEFORE(now, t->heap[1]->deadline)) {
+        timer = t->heap[1];
+        uaio_timer_disarm(t, timer);
+        task = uaio_timer_task(timer);
+        if (t->expired[timer->expiry]) {
+            t->expired[timer->expiry](timer);
+        }
+        else if (task->status == UAIO_WAITING) {
+            task->status = UAIO_RUNNING;
+        }
+        fired++;
+    }
+
+    if (fired) {
+        t->stats.fired += fired;
+        t->stats.wakeups++;
+        t->stats.saved += fired - 1;
+    }
+
+    return fired;
+}
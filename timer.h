@@ -0,0 +1,92 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifndef TIMER_H_
+#define TIMER_H_
+
+
+#include "uaio.h"
+
+
+enum uaio_timerexpiry {
+    /* wakes the task up */
+    UAIO_TIMER_WAKE,
+
+    /* the timeout of a file wait, kept by the sleep timer */
+    UAIO_TIMER_FILE,
+
+    /* the deadline timer, the only one expiring this way */
+    UAIO_TIMER_DEADLINE,
+
+    UAIO_TIMER_EXPIRIES,
+};
+
+
+typedef void (*uaio_timerexpired_t) (struct uaio_timer *timer);
+
+
+/* Binary min-heap of the armed timers ordered by deadline, heap[0] is
+ * unused so the positions stored in the timers are one based and zero
+ * means "not armed". */
+struct uaio_timers {
+    struct uaio_timer **heap;
+    size_t count;
+    size_t size;
+    struct uaio_timerstats stats;
+
+    /* called on expiry by enum uaio_timerexpiry, instead of just waking
+     * the task up, if set */
+    uaio_timerexpired_t expired[UAIO_TIMER_EXPIRIES];
+};
+
+
+int
+uaio_timers_init(struct uaio_timers *t, size_t size);
+
+
+int
+uaio_timers_deinit(struct uaio_timers *t);
+
+
+uaio_time_t
+uaio_timers_now();
+
+
+struct uaio_task *
+uaio_timer_task(struct uaio_timer *timer);
+
+
+int
+uaio_timer_arm(struct uaio_timers *t, struct uaio_timer *timer,
+        uaio_time_t deadline, unsigned long slack, int expiry);
+
+
+void
+uaio_timer_disarm(struct uaio_timers *t, struct uaio_timer *timer);
+
+
+unsigned long
+uaio_timers_next(struct uaio_timers *t, uaio_time_t now,
+        unsigned long maxus);
+
+
+int
+uaio_timers_expire(struct uaio_timers *t, uaio_time_t now);
+
+
+#endif  // TIMER_H_
@@ -0,0 +1,325 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "uaio.h"
+
+
+/* Bytes asked from the kernel by each splice(2) or sendfile(2) */
+#define TRANSFER_CHUNK (1 << 16)
+
+
+#define TRANSFER_NOTSUPPORTED(e) \
+    (((e) == EINVAL) || ((e) == ENOSYS) || ((e) == EOPNOTSUPP))
+
+
+static size_t
+_chunk(struct uaio_transfer *t, size_t max) {
+    size_t remaining;
+
+    if (t->limit == 0) {
+        return max;
+    }
+
+    remaining = t->limit - t->done;
+    return (remaining < max)? remaining: max;
+}
+
+
+static int
+_wait(struct uaio_transfer *t, int fd, int events) {
+    t->waitfd = fd;
+    t->waitevents = events;
+    return -1;
+}
+
+
+/* Returns true when the transfer is finished */
+static bool
+_advance(struct uaio_transfer *t, size_t bytes) {
+    t->done += bytes;
+    if (t->progress) {
+        t->progress(t);
+    }
+
+    return t->limit && (t->done >= t->limit);
+}
+
+
+static int
+_buffered(struct uaio_transfer *t) {
+    ssize_t bytes;
+
+    if (t->buff == NULL) {
+        t->buff = uaio_malloc(UAIO_MEM_BUFFER, t->buffsize);
+        if (t->buff == NULL) {
+            return -1;
+        }
+    }
+
+    for (;;) {
+        if (t->pending == 0) {
+            bytes = read(t->infd, t->buff, _chunk(t, t->buffsize));
+            if (bytes < 0) {
+                return UAIO_MUSTWAIT(errno)? _wait(t, t->infd, UAIO_IN): -1;
+            }
+
+            if (bytes == 0) {
+                return 0;
+            }
+
+            t->head = 0;
+            t->pending = bytes;
+        }
+
+        bytes = write(t->outfd, t->buff + t->head, t->pending);
+        if (bytes < 0) {
+            return UAIO_MUSTWAIT(errno)? _wait(t, t->outfd, UAIO_OUT): -1;
+        }
+
+        t->head += bytes;
+        t->pending -= bytes;
+        if (_advance(t, bytes) && (t->pending == 0)) {
+            return 0;
+        }
+    }
+}
+
+
+#ifdef __linux__
+
+
+static int
+_sendfile(struct uaio_transfer *t) {
+    ssize_t bytes;
+
+    for (;;) {
+        bytes = sendfile(t->outfd, t->infd, NULL, _chunk(t, TRANSFER_CHUNK));
+        if (bytes < 0) {
+            if (UAIO_MUSTWAIT(errno)) {
+                return _wait(t, t->outfd, UAIO_OUT);
+            }
+
+            if (TRANSFER_NOTSUPPORTED(errno) && (t->done == 0)) {
+                t->mode = UAIO_TRANSFER_BUFFERED;
+                return _buffered(t);
+            }
+            return -1;
+        }
+
+        if (bytes == 0) {
+            return 0;
+        }
+
+        if (_advance(t, bytes)) {
+            return 0;
+        }
+    }
+}
+
+
+/* One side is a pipe, no intermediate pipe is needed */
+static int
+_splice_direct(struct uaio_transfer *t) {
+    struct pollfd fds[2];
+    ssize_t bytes;
+
+    for (;;) {
+        bytes = splice(t->infd, NULL, t->outfd, NULL,
+                _chunk(t, TRANSFER_CHUNK),
+                SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (bytes < 0) {
+            if (!UAIO_MUSTWAIT(errno)) {
+                return -1;
+            }
+
+            /* Find out which side is blocking */
+            fds[0].fd = t->infd;
+            fds[0].events = POLLIN;
+            fds[1].fd = t->outfd;
+            fds[1].events = POLLOUT;
+            if (poll(fds, 2, 0) < 0) {
+                return -1;
+            }
+
+            if (fds[0].revents & (POLLIN | POLLHUP)) {
+                return _wait(t, t->outfd, UAIO_OUT);
+            }
+            return _wait(t, t->infd, UAIO_IN);
+        }
+
+        if (bytes == 0) {
+            return 0;
+        }
+
+        if (_advance(t, bytes)) {
+            return 0;
+        }
+    }
+}
+
+
+static int
+_splice(struct uaio_transfer *t) {
+    ssize_t bytes;
+
+    if ((t->pipe[0] == -1) && pipe2(t->pipe, O_NONBLOCK | O_CLOEXEC)) {
+        return -1;
+    }
+
+    for (;;) {
+        if (t->pending == 0) {
+            bytes = splice(t->infd, NULL, t->pipe[1], NULL,
+                    _chunk(t, TRANSFER_CHUNK),
+                    SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            if (bytes < 0) {
+                if (UAIO_MUSTWAIT(errno)) {
+                    return _wait(t, t->infd, UAIO_IN);
+                }
+
+                if (TRANSFER_NOTSUPPORTED(errno) && (t->done == 0)) {
+                    t->mode = UAIO_TRANSFER_BUFFERED;
+                    return _buffered(t);
+                }
+                return -1;
+            }
+
+            if (bytes == 0) {
+                return 0;
+            }
+            t->pending = bytes;
+        }
+
+        bytes = splice(t->pipe[0], NULL, t->outfd, NULL, t->pending,
+                SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (bytes < 0) {
+            return UAIO_MUSTWAIT(errno)? _wait(t, t->outfd, UAIO_OUT): -1;
+        }
+
+        t->pending -= bytes;
+        if (_advance(t, bytes) && (t->pending == 0)) {
+            return 0;
+        }
+    }
+}
+
+
+#endif  // __linux__
+
+
+int
+uaio_transfer_init(struct uaio_transfer *t, int infd, int outfd,
+        size_t limit, size_t buffsize) {
+#ifdef __linux__
+    struct stat instat;
+    struct stat outstat;
+#endif
+
+    if ((t == NULL) || (infd < 0) || (outfd < 0) || (buffsize < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(t, 0, sizeof(struct uaio_transfer));
+    t->infd = infd;
+    t->outfd = outfd;
+    t->limit = limit;
+    t->buffsize = buffsize;
+    t->pipe[0] = -1;
+    t->pipe[1] = -1;
+    t->mode = UAIO_TRANSFER_BUFFERED;
+
+#ifdef __linux__
+    if (fstat(infd, &instat) || fstat(outfd, &outstat)) {
+        return -1;
+    }
+
+    if (S_ISREG(instat.st_mode)) {
+        t->mode = UAIO_TRANSFER_SENDFILE;
+    }
+    else if (S_ISFIFO(instat.st_mode) || S_ISFIFO(outstat.st_mode)) {
+        t->mode = UAIO_TRANSFER_SPLICEDIRECT;
+    }
+    else {
+        t->mode = UAIO_TRANSFER_SPLICE;
+    }
+#endif
+
+    return 0;
+}
+
+
+int
+uaio_transfer_deinit(struct uaio_transfer *t) {
+    if (t == NULL) {
+        return -1;
+    }
+
+    if (t->buff) {
+        uaio_free(UAIO_MEM_BUFFER, t->buff);
+        t->buff = NULL;
+    }
+
+    if (t->pipe[0] != -1) {
+        close(t->pipe[0]);
+        close(t->pipe[1]);
+        t->pipe[0] = -1;
+        t->pipe[1] = -1;
+    }
+
+    return 0;
+}
+
+
+/* Moves as many bytes as the files allow. Returns zero when the limit is
+ * reached or the input is exhausted, otherwise -1 and errno. On EAGAIN
+ * the waitfd and waitevents tell what to wait for. */
+int
+uaio_transfer_step(struct uaio_transfer *t) {
+    if (t->limit && (t->done >= t->limit)) {
+        return 0;
+    }
+
+    switch (t->mode) {
+#ifdef __linux__
+        case UAIO_TRANSFER_SENDFILE:
+            return _sendfile(t);
+
+        case UAIO_TRANSFER_SPLICEDIRECT:
+            return _splice_direct(t);
+
+        case UAIO_TRANSFER_SPLICE:
+            return _splice(t);
+#endif
+
+        default:
+            return _buffered(t);
+    }
+}
@@ -1,3 +1,10 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
 #include <errno.h>
 #include <string.h>
 #include <freertos/FreeRTOS.h>
@@ -10,119 +17,781 @@
 #include "taskpool.h"
 #include "select.h"
 #include "semaphore.h"
+#include "simtime.h"
+#include "waitqueue.h"
+#include "timer.h"
+#ifdef CONFIG_UAIO_OFFLOAD
+#include "offload.h"
+#endif
+#ifdef CONFIG_UAIO_URING
+#include "uring.h"
+#endif
+#ifdef CONFIG_UAIO_PIPE
+#include "pipe.h"
+#endif
+
+
+#if (defined(CONFIG_UAIO_OFFLOAD) || defined(CONFIG_UAIO_PIPE)) && \
+    (CONFIG_UAIO_NOTIFY_INDEX >= configTASK_NOTIFICATION_ARRAY_ENTRIES)
+#error "CONFIG_UAIO_NOTIFY_INDEX needs more task notification entries"
+#endif
+
+
+/* The offload and pipe completions notify the loop task, which ppoll(2)
+ * can't see, so uaio_idle_ppoll watches an eventfd too */
+#if defined(__linux__) && \
+    (defined(CONFIG_UAIO_OFFLOAD) || defined(CONFIG_UAIO_PIPE))
+#define UAIO_WAKEFD
+#define UAIO_WAKESLOTS 1
+#else
+#define UAIO_WAKESLOTS 0
+#endif
 
 
 struct uaio {
     struct uaio_taskpool taskpool;
+    struct uaio_timers timers;
 #ifdef CONFIG_UAIO_SELECT
     struct uaio_select select;
 #endif
+#ifdef CONFIG_UAIO_OFFLOAD
+    struct uaio_offload offload;
+    bool offloadready;
+#endif
+    uaio_idle_t idle;
+    void *idlearg;
+#ifdef UAIO_WAKEFD
+    /* wakes uaio_idle_ppoll up on offload and pipe completions */
+    int wakefd;
+#endif
+#ifdef CONFIG_UAIO_ADMISSION
+    struct uaio_waitqueue admission;
+    size_t admissionlimit;
+    struct uaio_admissionstats admissionstats;
+
+    /* free slots held for the woken spawners, and the one spawning into
+     * its slot right now */
+    size_t reserved;
+    struct uaio_task *claimer;
+#endif
+#ifdef CONFIG_UAIO_BUSYPOLL
+    struct uaio_busypollstats busypoll;
+
+    /* one bit per spin, set on hits */
+    unsigned char pollhistory;
+
+    /* a task was dispatched since the last spin */
+    bool pollarmed;
+
+    /* moving average of the idle hook overshoot */
+    unsigned long wakelatency;
+#endif
 };
 
 
 static struct uaio *_uaio = NULL;
 
 
-static void
-_tasksleep_callback(struct uaio_task *task) {
-    // esp_timer_delete(task->sleep);
-    ESP_ERROR_CHECK(esp_timer_delete(task->sleep));
-    task->sleep = NULL;
+#ifdef CONFIG_UAIO_COMPACT
+/* Each task holds two of them, the time, the slack and the heap position
+ * are narrowed to 32, 32 and 16 bits */
+_Static_assert(sizeof(struct uaio_timer) <= 3 * sizeof(uint32_t),
+        "the compact timer grew");
+#endif
 
-    if (task && (task->status == UAIO_WAITING)) {
-        task->status = UAIO_RUNNING;
+
+/* Longer timeouts would wrap the narrowed time around, the sum is not
+ * computed since unsigned long may be 32 bits wide */
+static int
+_span(unsigned long us, unsigned long slack_us) {
+#ifdef CONFIG_UAIO_COMPACT
+    if ((slack_us > UAIO_TIME_MAXSPAN) ||
+            (us > (UAIO_TIME_MAXSPAN - slack_us))) {
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+
+void
+uaio_task_sleep_slack(struct uaio_task *task, unsigned long us,
+        unsigned long slack_us) {
+    if (_span(us, slack_us) || uaio_timer_arm(&_uaio->timers, &task->sleep,
+                uaio_now() + us, slack_us, UAIO_TIMER_WAKE)) {
+        task->eno = errno;
+        task->status = UAIO_TERMINATING;
+        return;
     }
+
+    task->status = UAIO_WAITING;
+}
+
+
+void
+uaio_task_sleep_cancel(struct uaio_task *task) {
+    uaio_timer_disarm(&_uaio->timers, &task->sleep);
 }
 
 
 void
 uaio_task_sleep(struct uaio_task *task, unsigned long us) {
-    const esp_timer_create_args_t oneshot_timer_args = {
-            .callback = (void (*)(void *)) &_tasksleep_callback,
-            .arg = (void*) task
-    };
+    uaio_task_sleep_slack(task, us, 0);
+}
+
+
+uaio_time_t
+uaio_now() {
+    return uaio_timers_now();
+}
+
+
+void
+uaio_ticker_start(struct uaio_ticker *ticker, unsigned long period_us) {
+    ticker->next = uaio_now();
+    ticker->period = period_us;
+    ticker->overruns = 0;
+}
+
+
+void
+uaio_ticker_wait(struct uaio_task *task, struct uaio_ticker *ticker) {
+    uaio_time_t now = uaio_now();
+    unsigned long missed;
+
+    if ((ticker->period == 0) || _span(ticker->period, 0)) {
+        task->eno = EINVAL;
+        task->status = UAIO_TERMINATING;
+        return;
+    }
+
+    ticker->next += ticker->period;
+    if (UAIO_TIME_BEFORE(ticker->next, now)) {
+        /* Keep the phase, skip the ticks already passed, a tick due right
+         * now is on time */
+        missed = (now - ticker->next - 1) / ticker->period + 1;
+        ticker->next += (uaio_time_t)missed * ticker->period;
+        ticker->overruns += missed;
+    }
+
+    if (uaio_timer_arm(&_uaio->timers, &task->sleep, ticker->next, 0,
+                UAIO_TIMER_WAKE)) {
+        task->eno = errno;
+        task->status = UAIO_TERMINATING;
+        return;
+    }
+
     task->status = UAIO_WAITING;
-    ESP_ERROR_CHECK(esp_timer_create(&oneshot_timer_args, &task->sleep));
-    ESP_ERROR_CHECK(esp_timer_start_once(task->sleep, us));
 }
 
 
-#ifdef CONFIG_UAIO_SELECT
-
-
+void
+uaio_timerstats(struct uaio_timerstats *out) {
+    memcpy(out, &_uaio->timers.stats, sizeof(struct uaio_timerstats));
+}
+
+
+void
+uaio_footprint(struct uaio_footprint *out) {
+    out->task = sizeof(struct uaio_task);
+
+    /* Each task owns a sleep and a deadline timer */
+    out->timerslots = 2 * sizeof(struct uaio_timer *);
+    out->pertask = out->task + out->timerslots;
+    out->frame = sizeof(struct uaio_basecall);
+#ifdef CONFIG_UAIO_SELECT
+    out->perfile = sizeof(struct uaio_fileevent);
+#else
+    out->perfile = 0;
+#endif
+    out->core = sizeof(struct uaio);
+}
+
+
+#ifdef CONFIG_UAIO_BUSYPOLL
+void
+uaio_busypollstats(struct uaio_busypollstats *out) {
+    memcpy(out, &_uaio->busypoll, sizeof(struct uaio_busypollstats));
+}
+#endif  // CONFIG_UAIO_BUSYPOLL
+
+
+/* True if the idle hook, maybe behind a recorder, waits for the files */
+static inline bool
+_idle_polls(uaio_idle_t hook, void *arg) {
+#ifdef __linux__
+    if (hook == uaio_idle_record) {
+        hook = ((struct uaio_idlerecorder *)arg)->hook;
+    }
+
+    return hook == uaio_idle_ppoll;
+#else
+    return false;
+#endif
+}
+
+
+int
+uaio_idle_set(uaio_idle_t hook, void *arg) {
+    if (hook == NULL) {
+        hook = uaio_idle_block;
+    }
+
+#ifdef UAIO_WAKEFD
+    if (_idle_polls(hook, arg) && (_uaio->wakefd == -1)) {
+        _uaio->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_uaio->wakefd == -1) {
+            return -1;
+        }
+    }
+#endif
+
+    _uaio->idle = hook;
+    _uaio->idlearg = arg;
+    return 0;
+}
+
+
+/* Blocks the loop's FreeRTOS task, the offload workers and the pipe
+ * producers notify it on CONFIG_UAIO_NOTIFY_INDEX */
+void
+uaio_idle_block(unsigned long timeout_us, void *arg) {
+    TickType_t xdelay = portMAX_DELAY;
+
+    if (timeout_us != UAIO_IDLE_FOREVER) {
+        /* Round up, so the loop does not spin before the deadline */
+        xdelay = (timeout_us + portTICK_PERIOD_MS * 1000 - 1) / 1000 /
+            portTICK_PERIOD_MS;
+    }
+
+#if defined(CONFIG_UAIO_OFFLOAD) || defined(CONFIG_UAIO_PIPE)
+    ulTaskNotifyTakeIndexed(CONFIG_UAIO_NOTIFY_INDEX, pdTRUE, xdelay);
+#else
+    vTaskDelay(xdelay);
+#endif
+}
+
+
+/* Light sleeps the chip for the whole idle window, short windows are not
+ * worth it and fall back to blocking. Without a deadline only the wakeup
+ * sources configured by the application end the sleep. Offload workers
+ * can't run during the sleep. */
+void
+uaio_idle_lightsleep(unsigned long timeout_us, void *arg) {
+    if (timeout_us < CONFIG_UAIO_IDLE_LIGHTSLEEP_MIN_US) {
+        uaio_idle_block(timeout_us, arg);
+        return;
+    }
+
+    if (timeout_us == UAIO_IDLE_FOREVER) {
+        esp_light_sleep_start();
+        return;
+    }
+
+    /* The timer must not end a later sleep without a deadline */
+    esp_sleep_enable_timer_wakeup(timeout_us);
+    esp_light_sleep_start();
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+}
+
+
+void
+uaio_idle_record(unsigned long timeout_us, void *arg) {
+    struct uaio_idlerecorder *r = arg;
+
+    if (r->size) {
+        r->windows[r->count % r->size] = timeout_us;
+    }
+    r->count++;
+
+    if (r->hook) {
+        r->hook(timeout_us, r->arg);
+    }
+    else {
+        uaio_idle_block(timeout_us, r->arg);
+    }
+}
+
+
+#ifdef __linux__
+
+
+/* Waits for the monitored files and the deadline at once */
+void
+uaio_idle_ppoll(unsigned long timeout_us, void *arg) {
+    struct timespec ts;
+    struct timespec *tsp = NULL;
+#ifdef CONFIG_UAIO_SELECT
+    struct uaio_fileinterest interest[CONFIG_UAIO_SELECT_MAXFILES];
+    struct pollfd pfds[CONFIG_UAIO_SELECT_MAXFILES + UAIO_WAKESLOTS];
+    int i;
+#elif defined(UAIO_WAKEFD)
+    struct pollfd pfds[UAIO_WAKESLOTS];
+#else
+    struct pollfd *pfds = NULL;
+#endif
+#ifdef UAIO_WAKEFD
+    uint64_t count;
+#endif
+    int nfds = 0;
+
+#ifdef CONFIG_UAIO_SELECT
+    nfds = uaio_file_interest(interest, CONFIG_UAIO_SELECT_MAXFILES);
+    for (i = 0; i < nfds; i++) {
+        pfds[i].fd = interest[i].fd;
+        pfds[i].events = 0;
+        pfds[i].revents = 0;
+        if (interest[i].events & UAIO_IN) {
+            pfds[i].events |= POLLIN;
+        }
+
+        if (interest[i].events & UAIO_OUT) {
+            pfds[i].events |= POLLOUT;
+        }
+
+        if (interest[i].events & UAIO_ERR) {
+            pfds[i].events |= POLLPRI;
+        }
+    }
+#endif
+
+#ifdef UAIO_WAKEFD
+    if (_uaio->wakefd != -1) {
+        pfds[nfds].fd = _uaio->wakefd;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        nfds++;
+    }
+#endif
+
+    if (timeout_us != UAIO_IDLE_FOREVER) {
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        tsp = &ts;
+    }
+
+    ppoll(pfds, nfds, tsp, NULL);
+#ifdef UAIO_WAKEFD
+    /* EAGAIN: nobody woke us up */
+    if ((_uaio->wakefd != -1) &&
+            (read(_uaio->wakefd, &count, sizeof(count)) == -1) &&
+            (errno != EAGAIN)) {
+        ERROR("read(wakefd)");
+    }
+#endif
+}
+
+
+#endif
+
+
+#ifdef UAIO_WAKEFD
+/* Called after notifying the loop task, from any thread */
+void
+uaio_idle_wakeup() {
+    uint64_t one = 1;
+
+    /* EAGAIN: the counter is full, the loop is signalled already */
+    if ((_uaio->wakefd != -1) &&
+            (write(_uaio->wakefd, &one, sizeof(one)) == -1) &&
+            (errno != EAGAIN)) {
+        ERROR("write(wakefd)");
+    }
+}
+#endif
+
+
+/* How long the loop may stay idle without a timer, the select module must
+ * be polled unless the idle hook watches the files itself. */
+static unsigned long
+_idle_maxus() {
+#ifdef CONFIG_UAIO_SELECT
+    if (_uaio->select.waitingfiles &&
+            !_idle_polls(_uaio->idle, _uaio->idlearg)) {
+        return CONFIG_UAIO_TICKTIMEOUT_LONG_US;
+    }
+#endif
+
+    return UAIO_IDLE_FOREVER;
+}
+
+
+#ifdef CONFIG_UAIO_SELECT
+
+
+static void
+_file_expired(struct uaio_timer *timer) {
+    struct uaio_task *task = uaio_timer_task(timer);
+
+    uaio_select_forget_task(&_uaio->select, task);
+    task->timedout = true;
+    if (task->status == UAIO_WAITING) {
+        task->status = UAIO_RUNNING;
+    }
+}
+
+
+/* The timeout of a file wait is kept by the task's sleep timer */
+int
+uaio_file_monitor(struct uaio_task *task, int fd, int events,
+        unsigned int timeout_us) {
+    task->timedout = false;
+    if (uaio_select_monitor(&_uaio->select, task, fd, events)) {
+        return -1;
+    }
+
+    if (timeout_us == 0) {
+        return 0;
+    }
+
+    if (_span(timeout_us, 0) || uaio_timer_arm(&_uaio->timers, &task->sleep,
+                uaio_now() + timeout_us, 0, UAIO_TIMER_FILE)) {
+        uaio_select_forget_task(&_uaio->select, task);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int
+uaio_file_forget(int fd) {
+    return uaio_select_forget(&_uaio->select, fd);
+}
+
+
+int
+uaio_file_interest(struct uaio_fileinterest *out, size_t size) {
+    return uaio_select_interest(&_uaio->select, out, size);
+}
+
+
+#endif
+
+
+#ifdef CONFIG_UAIO_OFFLOAD
+
+
+int
+uaio_offload(struct uaio_task *task, uaio_offload_t func, void *arg,
+        size_t size) {
+    if ((func == NULL) || (size && (arg == NULL))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return uaio_offload_submit(&_uaio->offload, task, func, arg, size);
+}
+
+
+#endif  // CONFIG_UAIO_OFFLOAD
+
+
+struct uaio_task *
+uaio_task_next(struct uaio *c, struct uaio_task *task,
+        enum uaio_taskstatus statuses) {
+    return uaio_taskpool_next(&c->taskpool, task, statuses);
+}
+
+
+#ifdef CONFIG_UAIO_ADMISSION
+/* Holds a free slot for the first spawner in the admission queue */
+static void
+_admit() {
+    struct uaio_task *task = uaio_waitqueue_pop(&_uaio->admission);
+
+    if (task == NULL) {
+        return;
+    }
+
+    task->reserved = true;
+    _uaio->reserved++;
+    if (task->status == UAIO_WAITING) {
+        task->status = UAIO_RUNNING;
+    }
+}
+#endif
+
+
+/* Takes the task out of whatever it's waiting for */
+static void
+_detach(struct uaio_task *task) {
+#ifdef CONFIG_UAIO_OFFLOAD
+    if (task->waitreason == UAIO_WAIT_OFFLOAD) {
+        /* Orphan the running job */
+        task->offload->task = NULL;
+        task->waitreason = UAIO_WAIT_NONE;
+        task->offload = NULL;
+    }
+#endif
+#ifdef CONFIG_UAIO_URING
+    uaio_uring_orphan(task);
+#endif
+#ifdef CONFIG_UAIO_SELECT
+    uaio_select_forget_task(&_uaio->select, task);
+#endif
+    uaio_waitqueue_remove(task);
+    uaio_timer_disarm(&_uaio->timers, &task->sleep);
+#ifdef CONFIG_UAIO_BUFPOOL
+    if (task->bufheld) {
+        uaio_bufpool_unhold(task);
+    }
+#endif
+#ifdef CONFIG_UAIO_ADMISSION
+    if (task->reserved) {
+        /* Pass the held slot on */
+        task->reserved = false;
+        _uaio->reserved--;
+        _admit();
+    }
+#endif
+}
+
+
+struct uaio_deadline {
+    struct uaio_basecall *frame;
+    uaio_time_t at;
+    struct uaio_deadline *outer;
+};
+
+
+/* Arms the timer at the earliest of the task's deadlines */
+static void
+_deadline_rearm(struct uaio_task *task) {
+    struct uaio_deadline *d = task->deadlines;
+    uaio_time_t at;
+
+    uaio_timer_disarm(&_uaio->timers, &task->deadline);
+    if (d == NULL) {
+        return;
+    }
+
+    at = d->at;
+    for (d = d->outer; d; d = d->outer) {
+        if (UAIO_TIME_BEFORE(d->at, at)) {
+            at = d->at;
+        }
+    }
+
+    /* The heap is sized for it, so arming never fails here */
+    uaio_timer_arm(&_uaio->timers, &task->deadline, at, 0,
+            UAIO_TIMER_DEADLINE);
+}
+
+
+static void
+_deadline_pop(struct uaio_task *task) {
+    struct uaio_deadline *d = task->deadlines;
+
+    task->deadlines = d->outer;
+    uaio_free(UAIO_MEM_FRAME, d);
+}
+
+
+#ifdef CONFIG_UAIO_SEMAPHORE
+/* Whether the frame is unwound, the ones above the deadline's frame */
+static bool
+_unwound(struct uaio_task *task, struct uaio_basecall *frame,
+        struct uaio_basecall *deadlineframe) {
+    struct uaio_basecall *f;
+
+    for (f = task->current; f && (f != deadlineframe); f = f->parent) {
+        if (f == frame) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/* The semaphores living in the state of the frames about to be unwound
+ * are gone, their children must not release them afterwards. A semaphore
+ * without a known frame is assumed to be one of them. */
+static void
+_semaphore_orphan(struct uaio_task *task,
+        struct uaio_basecall *deadlineframe) {
+    struct uaio_task *child = NULL;
+    struct uaio_semaphore *s;
+
+    while ((child = uaio_taskpool_next(&_uaio->taskpool, child,
+                    UAIO_RUNNING | UAIO_WAITING | UAIO_TERMINATING))) {
+        s = child->semaphore;
+        if ((s == NULL) || (s->task != task)) {
+            continue;
+        }
+
+        if ((s->frame == NULL) || _unwound(task, s->frame, deadlineframe)) {
+            child->semaphore = NULL;
+        }
+    }
+}
+#endif
+
+
+static void
+_deadline_expired(struct uaio_timer *timer) {
+    struct uaio_task *task = uaio_timer_task(timer);
+    struct uaio_deadline *d;
+    struct uaio_basecall *frame = NULL;
+    uaio_time_t now = uaio_now();
+
+    /* Unwind up to the outermost expired one */
+    for (d = task->deadlines; d; d = d->outer) {
+        if (!UAIO_TIME_BEFORE(now, d->at)) {
+            frame = d->frame;
+        }
+    }
+
+    /* The awaited call is already done, but the awaiter is not resumed
+     * yet, it rearms the timer for the outer deadlines when it is */
+    if ((frame == NULL) || (task->current == frame)) {
+        return;
+    }
+
+    if (!(task->status & (UAIO_RUNNING | UAIO_WAITING))) {
+        return;
+    }
+
+    _detach(task);
+#ifdef CONFIG_UAIO_SEMAPHORE
+    _semaphore_orphan(task, frame);
+#endif
+    task->deadlineframe = frame;
+    task->unwinding = true;
+    task->status = UAIO_TERMINATING;
+}
+
+
+/* Arms the deadline of the current frame's next await, the deadlines of
+ * nested awaits stack up, the earliest one fires first */
+int
+uaio_task_deadline(struct uaio_task *task, unsigned long us) {
+    struct uaio_deadline *d;
+
+    if (_span(us, 0)) {
+        return -1;
+    }
+
+    d = uaio_malloc(UAIO_MEM_FRAME, sizeof(struct uaio_deadline));
+    if (d == NULL) {
+        return -1;
+    }
+
+    d->frame = task->current;
+    d->at = uaio_now() + us;
+    d->outer = task->deadlines;
+    task->deadlines = d;
+    task->timedout = false;
+    _deadline_rearm(task);
+    return 0;
+}
+
+
+/* Called by the awaiter when it's resumed, or when its frame is freed */
+void
+uaio_task_deadline_end(struct uaio_task *task) {
+    if (task->deadlines) {
+        _deadline_pop(task);
+    }
+
+    _deadline_rearm(task);
+    task->deadlineframe = NULL;
+    task->unwinding = false;
+}
+
+
+void
+uaio_task_killall() {
+    struct uaio_task *task = NULL;
+
+    while ((task = uaio_taskpool_next(&_uaio->taskpool, task,
+                    UAIO_RUNNING | UAIO_WAITING))) {
+        task->status = UAIO_TERMINATING;
+    }
+}
+
+
 int
-uaio_file_monitor(struct uaio_task *task, int fd, int events,
-        unsigned int timeout_us) {
-    struct uaio_select *s = &_uaio->select;
-    struct uaio_fileevent *fe;
-    if ((fd < 0) || (fd > s->maxfileno) || (s->eventscount == s->maxfileno)) {
+uaio_generator_next(struct uaio_task *task, struct uaio_generator *gen) {
+    if (gen->frame == NULL) {
+        errno = ENODATA;
         return -1;
     }
 
-    if (timeout_us > 0) {
-        clock_gettime(CLOCK_MONOTONIC, &task->select_timestamp);
-        task->select_timeout_us = timeout_us;
-    }
-    else {
-        task->select_timestamp.tv_sec = 0;
-        task->select_timestamp.tv_nsec = 0;
-        task->select_timeout_us = 0;
-    }
-
-    // struct timespec ts = task->select_timestamp;
-    // DEBUG("%lld.%.9ld", (long long)ts.tv_sec, ts.tv_nsec);
-
-    fe = &s->events[s->eventscount++];
-    s->waitingfiles++;
-    fe->events = events;
-    fe->task = task;
-    fe->fd = fd;
+    gen->yielded = false;
+    gen->value = NULL;
+    gen->frame->parent = task->current;
+    gen->outer = task->generators;
+    task->generators = gen;
+    task->current = gen->frame;
+    task->status = UAIO_RUNNING;
     return 0;
 }
 
 
-int
-uaio_select_forget(int fd) {
-    int i;
-    struct uaio_fileevent *fe;
-
-    for (i = 0; i < _uaio->select.eventscount; i++) {
-        fe = &_uaio->select.events[i];
-        if (fe->fd == fd) {
-            FILEEVENT_RESET(fe);
-            _uaio->select.waitingfiles--;
-            return 0;
-        }
+void
+uaio_generator_yield(struct uaio_task *task, struct uaio_generator *gen,
+        void *value) {
+    if (task->current != gen->frame) {
+        task->eno = EINVAL;
+        task->status = UAIO_TERMINATING;
+        return;
     }
 
-    return -1;
+    /* Detach the producer and go back to the consumer */
+    gen->value = value;
+    gen->yielded = true;
+    task->generators = gen->outer;
+    task->current = gen->frame->parent;
+    gen->frame->parent = NULL;
+    task->status = UAIO_RUNNING;
 }
 
 
-#endif
-
+/* Called by the consumer when it's resumed, a producer that did not yield
+ * has finished and its frame is already freed and cleared by the loop. */
+void *
+uaio_generator_take(struct uaio_generator *gen) {
+    if (!gen->yielded) {
+        return NULL;
+    }
 
-struct uaio_task *
-uaio_task_next(struct uaio *c, struct uaio_task *task,
-        enum uaio_taskstatus statuses) {
-    return uaio_taskpool_next(&c->taskpool, task, statuses);
+    gen->yielded = false;
+    return gen->value;
 }
 
 
+/* Drops a suspended generator without running it to the end. Its
+ * UAIO_FINALLY runs right away, it can't await, so it's fine to close
+ * from the consumer's own UAIO_FINALLY as well. */
 void
-uaio_task_killall() {
-    struct uaio_task *task = NULL;
+uaio_generator_close(struct uaio_task *task, struct uaio_generator *gen) {
+    struct uaio_basecall *current = task->current;
+    enum uaio_taskstatus status = task->status;
 
-    while ((task = uaio_taskpool_next(&_uaio->taskpool, task,
-                    UAIO_RUNNING | UAIO_WAITING))) {
-        task->status = UAIO_TERMINATING;
+    if (gen->frame == NULL) {
+        return;
     }
+
+    task->current = gen->frame;
+    gen->frame->line = -1;
+    gen->frame->invoke(task);
+    task->current = current;
+    task->status = status;
+
+    uaio_free(UAIO_MEM_FRAME, gen->frame);
+    gen->frame = NULL;
+    gen->value = NULL;
+    gen->yielded = false;
 }
 
 
 static inline bool
 _step(struct uaio_task *task) {
     struct uaio_basecall *call = task->current;
+    struct uaio_generator *gen;
 
 start:
     /* Pre execution */
@@ -139,10 +808,36 @@ start:
     }
 
     if (task->status == UAIO_TERMINATED) {
+        gen = task->generators;
+        if (gen && (gen->frame == call)) {
+            /* The producer is done or unwound */
+            task->generators = gen->outer;
+            gen->frame = NULL;
+        }
+
         task->current = call->parent;
-        free(call);
-        if (task->current != NULL) {
-            task->status = UAIO_RUNNING;
+        if (task->deadlines && (task->deadlines->frame == call)) {
+            /* The awaiter itself is gone, drop its deadline */
+            _deadline_pop(task);
+            _deadline_rearm(task);
+        }
+        uaio_free(UAIO_MEM_FRAME, call);
+        if (task->current == NULL) {
+            return true;
+        }
+
+        task->status = UAIO_RUNNING;
+        if (task->unwinding && (task->current != task->deadlineframe)) {
+            /* Keep unwinding up to the frame awaiting with a deadline */
+            call = task->current;
+            task->status = UAIO_TERMINATING;
+            goto start;
+        }
+
+        if (task->unwinding) {
+            task->unwinding = false;
+            task->timedout = true;
+            task->eno = ETIMEDOUT;
         }
     }
 
@@ -153,51 +848,260 @@ start:
 struct uaio_task *
 uaio_task_new() {
     struct uaio_task *task;
+#ifdef CONFIG_UAIO_ADMISSION
+    struct uaio_taskpool *taskpool = &_uaio->taskpool;
+
+    if (_uaio->claimer) {
+        _uaio->claimer->reserved = false;
+        _uaio->claimer = NULL;
+        _uaio->reserved--;
+    }
+    else if ((taskpool->size - taskpool->count) <= _uaio->reserved) {
+        /* The free slots are held for the queued spawners */
+        errno = ENOSPC;
+        return NULL;
+    }
+#endif
 
     /* Register task */
     task = uaio_taskpool_lease(&_uaio->taskpool);
     if (task == NULL) {
+        errno = ENOSPC;
         return NULL;
     }
 
+#ifdef CONFIG_UAIO_TASKDUMP
+    task->seen = task->status;
+    task->since = uaio_now();
+#endif
     return task;
 }
 
 
+/* Returns the slot to the pool and lets the first spawner in the
+ * admission queue take it */
+static int
+_release(struct uaio_task *task) {
+    if (uaio_taskpool_release(&_uaio->taskpool, task)) {
+        return -1;
+    }
+
+#ifdef CONFIG_UAIO_ADMISSION
+    _admit();
+#endif
+    return 0;
+}
+
+
 int
 uaio_task_dispose(struct uaio_task *task) {
-    return uaio_taskpool_release(&_uaio->taskpool, task);
+    return _release(task);
+}
+
+
+#ifdef CONFIG_UAIO_ADMISSION
+void
+uaio_admission_limit(size_t maxdepth) {
+    _uaio->admissionlimit = maxdepth;
+}
+
+
+void
+uaio_admissionstats(struct uaio_admissionstats *out) {
+    memcpy(out, &_uaio->admissionstats, sizeof(struct uaio_admissionstats));
+    out->depth = _uaio->admission.count;
+}
+
+
+/* Queues the task after a failed spawn, only a full task pool is worth
+ * waiting for */
+int
+uaio_spawn_wait(struct uaio_task *task) {
+    struct uaio_admissionstats *stats = &_uaio->admissionstats;
+    struct uaio_waitqueue *q = &_uaio->admission;
+
+    _uaio->claimer = NULL;
+    if (errno != ENOSPC) {
+        return -1;
+    }
+
+    if (q->count >= _uaio->admissionlimit) {
+        stats->rejected++;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    task->queued = uaio_now();
+    task->admitting = true;
+
+    uaio_waitqueue_push(q, task);
+    if (q->count > stats->peakdepth) {
+        stats->peakdepth = q->count;
+    }
+
+    task->status = UAIO_WAITING;
+    return 0;
+}
+
+
+/* Called by a woken spawner right before it spawns again, the next task
+ * taken from the pool is the one held for it */
+void
+uaio_spawn_claim(struct uaio_task *task) {
+    if (task->reserved) {
+        _uaio->claimer = task;
+    }
+}
+
+
+void
+uaio_spawn_admitted(struct uaio_task *task) {
+    struct uaio_admissionstats *stats = &_uaio->admissionstats;
+    unsigned long waited;
+
+    _uaio->claimer = NULL;
+    if (!task->admitting) {
+        return;
+    }
+
+    waited = uaio_now() - task->queued;
+    task->admitting = false;
+    stats->admitted++;
+    stats->waited_us += waited;
+    if (waited > stats->maxwait_us) {
+        stats->maxwait_us = waited;
+    }
+}
+#endif  // CONFIG_UAIO_ADMISSION
+
+
+#ifdef CONFIG_UAIO_TASKDUMP
+struct uaio_task *
+uaio_task_walk(struct uaio_task *task) {
+    return uaio_taskpool_next(&_uaio->taskpool, task,
+            UAIO_RUNNING | UAIO_WAITING | UAIO_TERMINATING);
+}
+
+
+int
+uaio_task_info(struct uaio_task *task, struct uaio_taskinfo *out) {
+    struct uaio_basecall *call;
+
+    if ((task == NULL) || (task->status == UAIO_IDLE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(out, 0, sizeof(struct uaio_taskinfo));
+    out->task = task;
+    out->status = task->status;
+    out->eno = task->eno;
+    out->elapsed_us = uaio_now() - task->since;
+
+    for (call = task->current; call; call = call->parent) {
+        if (out->depth < UAIO_TASKINFO_MAXFRAMES) {
+            out->frames[out->depth].coro =
+                ((struct uaio_entitycall *)call)->coro;
+            out->frames[out->depth].line = call->line;
+        }
+        out->depth++;
+    }
+
+#ifdef CONFIG_UAIO_SELECT
+    out->fd = uaio_select_task(&_uaio->select, task, &out->events);
+#else
+    out->fd = -1;
+#endif
+
+    if (task->sleep.index) {
+        out->sleeping = true;
+        out->sleep = task->sleep.deadline;
+    }
+
+    if (task->deadline.index) {
+        out->deadlined = true;
+        out->deadline = task->deadline.deadline;
+    }
+
+    if (task->waitreason == UAIO_WAIT_QUEUE) {
+        out->waitqueue = task->waitqueue;
+    }
+#ifdef CONFIG_UAIO_SEMAPHORE
+    out->semaphore = task->semaphore;
+#endif
+    return 0;
 }
+#endif  // CONFIG_UAIO_TASKDUMP
 
 
 int
 uaio_init(size_t maxtasks) {
-    _uaio = malloc(sizeof(struct uaio));
+    return uaio_init_allocator(maxtasks, NULL);
+}
+
+
+int
+uaio_init_allocator(size_t maxtasks, const struct uaio_allocator *allocator) {
+    if (uaio_allocator_set(allocator)) {
+        return -1;
+    }
+
+    _uaio = uaio_calloc(UAIO_MEM_CORE, 1, sizeof(struct uaio));
     if (_uaio == NULL) {
         return -1;
     }
+#ifdef UAIO_WAKEFD
+    _uaio->wakefd = -1;
+#endif
+
+#ifdef CONFIG_UAIO_SIMTIME
+    uaio_simtime_reset();
+#endif
 
     /* Initialize task pool */
     if (uaio_taskpool_init(&_uaio->taskpool, maxtasks)) {
         goto failure;
     }
 
+    _uaio->idle = uaio_idle_block;
+#ifdef CONFIG_UAIO_ADMISSION
+    _uaio->admissionlimit = CONFIG_UAIO_ADMISSION_MAXDEPTH;
+#endif
+#ifdef CONFIG_UAIO_BUSYPOLL
+    _uaio->busypoll.budget_us = CONFIG_UAIO_BUSYPOLL_MAX_US / 9;
+#endif
+
+    /* Timer heap, each task owns a sleep and a deadline timer */
+    if (uaio_timers_init(&_uaio->timers, maxtasks * 2)) {
+        goto failure;
+    }
+    _uaio->timers.expired[UAIO_TIMER_DEADLINE] = _deadline_expired;
+#ifdef CONFIG_UAIO_SELECT
+    _uaio->timers.expired[UAIO_TIMER_FILE] = _file_expired;
+#endif
+
 
 #ifdef CONFIG_UAIO_SELECT
-    /* Select module */
-    memset(&_uaio->select, 0, sizeof(struct uaio_select));
-    /* select(2) requires the highest number of fileno instead of event count.
+    /* Select module
+     * select(2) requires the highest number of fileno instead of event count.
      * So, it must increased 3 times for (stdin, stdout and stderr) */
-    _uaio->select.maxfileno = CONFIG_UAIO_SELECT_MAXFILES + 3;
-    _uaio->select.events = calloc(_uaio->select.maxfileno,
-            sizeof(struct uaio_fileevent));
-    _uaio->select.eventscount = 0;
-    if (_uaio->select.events == NULL) {
+    if (uaio_select_init(&_uaio->select, CONFIG_UAIO_SELECT_MAXFILES + 3)) {
         goto failure;
     }
 
 #endif  // CONFIG_UAIO_SELECT
 
+#ifdef CONFIG_UAIO_URING
+    uaio_uring_init();
+#endif
+
+#ifdef CONFIG_UAIO_OFFLOAD
+    if (uaio_offload_init(&_uaio->offload)) {
+        goto failure;
+    }
+    _uaio->offloadready = true;
+#endif
+
     return 0;
 
 failure:
@@ -212,57 +1116,278 @@ uaio_destroy() {
         return -1;
     }
 
+#ifdef CONFIG_UAIO_OFFLOAD
+    if (_uaio->offloadready) {
+        uaio_offload_deinit(&_uaio->offload);
+    }
+#endif
+
+#ifdef CONFIG_UAIO_URING
+    uaio_uring_deinit();
+#endif
+
+#ifdef CONFIG_UAIO_SELECT
     if (_uaio->select.events) {
-        free(_uaio->select.events);
+        uaio_select_deinit(&_uaio->select);
+    }
+#endif
+
+    if (_uaio->timers.heap) {
+        uaio_timers_deinit(&_uaio->timers);
+    }
+
+#ifdef UAIO_WAKEFD
+    if (_uaio->wakefd != -1) {
+        close(_uaio->wakefd);
     }
+#endif
 
     if (uaio_taskpool_deinit(&_uaio->taskpool)) {
         return -1;
     }
 
-    free(_uaio);
+    uaio_free(UAIO_MEM_CORE, _uaio);
+    _uaio = NULL;
     errno = 0;
     return 0;
 }
 
 
+/* Expires the timers and polls the event sources, blocks no longer than
+ * timeout_us, or the next timer */
+static int
+_poll(unsigned long timeout_us) {
+    struct uaio_timers *timers = &_uaio->timers;
+    uaio_time_t now = uaio_now();
+
+    /* Don't block in select(2) if any timer woke a task up */
+    if (uaio_timers_expire(timers, now)) {
+        timeout_us = 0;
+    }
+    else {
+        timeout_us = uaio_timers_next(timers, now, timeout_us);
+    }
+
+#ifdef CONFIG_UAIO_PIPE
+    if (uaio_pipe_tick()) {
+        timeout_us = 0;
+    }
+#endif
+#ifdef CONFIG_UAIO_OFFLOAD
+    uaio_offload_tick(&_uaio->offload);
+#endif
+#ifdef CONFIG_UAIO_URING
+    uaio_uring_tick();
+#endif
+#ifdef CONFIG_UAIO_SELECT
+    if (uaio_select_tick(&_uaio->select, timeout_us)) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+
+#ifdef CONFIG_UAIO_TASKDUMP
+/* Wakeups happen all over the place, so the status changes are noticed
+ * around the steps */
+static void
+_seen(struct uaio_task *task) {
+    if (task->status != task->seen) {
+        task->seen = task->status;
+        task->since = uaio_now();
+    }
+}
+#endif
+
+
+/* Steps each runnable task once, starting from the given one */
+static void
+_dispatch(struct uaio_task *task) {
+    struct uaio_taskpool *taskpool = &_uaio->taskpool;
+
+    do {
+#ifdef CONFIG_UAIO_TASKDUMP
+        _seen(task);
+#endif
+        /* feed the watchdog */
+        vTaskDelay(1 / portTICK_PERIOD_MS);
+        if (_step(task)) {
+#ifdef CONFIG_UAIO_SEMAPHORE
+            if (task->semaphore) {
+                uaio_semaphore_release(task);
+            }
+#endif
+#ifdef CONFIG_UAIO_BUFPOOL
+            if (task->bufpool) {
+                uaio_bufpool_put(task->bufpool, task->pooled);
+            }
+#endif
+            _detach(task);
+            while (task->deadlines) {
+                _deadline_pop(task);
+            }
+            uaio_timer_disarm(&_uaio->timers, &task->deadline);
+            _release(task);
+        }
+#ifdef CONFIG_UAIO_TASKDUMP
+        else {
+            _seen(task);
+        }
+#endif
+    } while ((task = uaio_taskpool_next(taskpool, task,
+                UAIO_RUNNING | UAIO_TERMINATING)));
+}
+
+
+#if defined(CONFIG_UAIO_BUSYPOLL) && !defined(CONFIG_UAIO_SIMTIME)
+/* Spins with zero timeout polls after some activity instead of blocking
+ * in select(2), no longer than the budget or the next timer, then falls
+ * back to the blocking poll. The budget scales with the number of the
+ * last eight spins that a full budget would have caught. */
+static int
+_busypoll(unsigned long timeout_us) {
+    struct uaio_busypollstats *stats = &_uaio->busypoll;
+    struct uaio_taskpool *taskpool = &_uaio->taskpool;
+    uaio_time_t start;
+    uaio_time_t now;
+    unsigned long budget;
+    bool hit = false;
+
+    if (!_uaio->pollarmed) {
+        return _poll(timeout_us);
+    }
+    _uaio->pollarmed = false;
+
+    /* A task is runnable already, nothing to wait for */
+    if (uaio_taskpool_next(taskpool, NULL, UAIO_RUNNING | UAIO_TERMINATING)) {
+        return _poll(0);
+    }
+
+    start = now = uaio_now();
+    budget = uaio_timers_next(&_uaio->timers, now, stats->budget_us);
+    while ((now - start) < budget) {
+        if (_poll(0)) {
+            return -1;
+        }
+
+        if (uaio_taskpool_next(taskpool, NULL,
+                    UAIO_RUNNING | UAIO_TERMINATING)) {
+            hit = true;
+            break;
+        }
+        now = uaio_now();
+    }
+
+    stats->polled_us += uaio_now() - start;
+    if (hit) {
+        stats->hits++;
+        stats->saved_us += _uaio->wakelatency;
+    }
+    else {
+        stats->misses++;
+        if (_poll(timeout_us)) {
+            return -1;
+        }
+
+        /* A near miss, a longer budget would have caught it */
+        hit = ((uaio_now() - start) <= CONFIG_UAIO_BUSYPOLL_MAX_US) &&
+            uaio_taskpool_next(taskpool, NULL,
+                    UAIO_RUNNING | UAIO_TERMINATING);
+    }
+
+    _uaio->pollhistory <<= 1;
+    if (hit) {
+        _uaio->pollhistory |= 1;
+    }
+
+    stats->budget_us = CONFIG_UAIO_BUSYPOLL_MAX_US *
+        (__builtin_popcount(_uaio->pollhistory) + 1) / 9;
+    return 0;
+}
+
+
+/* Idles and measures how late the hook returns after a deadline */
+static void
+_idle(unsigned long timeout_us) {
+    uaio_time_t deadline = uaio_now() + timeout_us;
+    uaio_time_t now;
+    unsigned long late;
+
+    _uaio->idle(timeout_us, _uaio->idlearg);
+    if (timeout_us == UAIO_IDLE_FOREVER) {
+        return;
+    }
+
+    now = uaio_now();
+    if (UAIO_TIME_BEFORE(now, deadline)) {
+        return;
+    }
+
+    late = now - deadline;
+    if (late > _uaio->wakelatency) {
+        _uaio->wakelatency += (late - _uaio->wakelatency) / 8;
+    }
+    else {
+        _uaio->wakelatency -= (_uaio->wakelatency - late) / 8;
+    }
+}
+#endif  // CONFIG_UAIO_BUSYPOLL
+
+
 int
 uaio_loop() {
     struct uaio_task *task = NULL;
     struct uaio_taskpool *taskpool = &_uaio->taskpool;
     unsigned int modtimeout = CONFIG_UAIO_TICKTIMEOUT_SHORT_US;
-    TickType_t xdelay;
+    unsigned long timeout;
 
 loop:
 
     while (taskpool->count) {
-#ifdef CONFIG_UAIO_SELECT
-        if (uaio_select_tick(&_uaio->select, modtimeout)) {
+#if defined(CONFIG_UAIO_BUSYPOLL) && !defined(CONFIG_UAIO_SIMTIME)
+        if (_busypoll(modtimeout)) {
+#else
+        if (_poll(modtimeout)) {
+#endif
             goto interrupt;
         }
-#endif
-        task = uaio_taskpool_next(taskpool, task,
+
+        task = uaio_taskpool_next(taskpool, NULL,
                 UAIO_RUNNING | UAIO_TERMINATING);
         if (task == NULL) {
             modtimeout = CONFIG_UAIO_TICKTIMEOUT_LONG_US;
-            xdelay = modtimeout / 1000 / portTICK_PERIOD_MS;
-            vTaskDelay(xdelay);
+
+            /* Idle until the next timer */
+            timeout = uaio_timers_next(&_uaio->timers, uaio_now(),
+                    _idle_maxus());
+#ifdef CONFIG_UAIO_URING
+            if (uaio_uring_wait(timeout) == 0) {
+                continue;
+            }
+#endif
+#ifdef CONFIG_UAIO_SIMTIME
+            /* Jump straight to the next timer unless the files must be
+             * polled, or nothing is armed at all */
+            if ((timeout == UAIO_IDLE_FOREVER) ||
+                    ((_idle_maxus() != UAIO_IDLE_FOREVER) &&
+                     (timeout > modtimeout))) {
+                timeout = modtimeout;
+            }
+            uaio_simtime_advance(timeout);
+#elif defined(CONFIG_UAIO_BUSYPOLL)
+            _idle(timeout);
+#else
+            _uaio->idle(timeout, _uaio->idlearg);
+#endif
             continue;
         }
 
-        do {
-            /* feed the watchdog */
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-            if (_step(task)) {
-#ifdef CONFIG_UAIO_SEMAPHORE
-                if (task->semaphore) {
-                    uaio_semaphore_release(task);
-                }
+        _dispatch(task);
+#ifdef CONFIG_UAIO_BUSYPOLL
+        _uaio->pollarmed = true;
 #endif
-                uaio_taskpool_release(taskpool, task);
-            }
-        } while ((task = uaio_taskpool_next(taskpool, task,
-                    UAIO_RUNNING | UAIO_TERMINATING)));
         modtimeout = CONFIG_UAIO_TICKTIMEOUT_SHORT_US;
     }
 
@@ -272,3 +1397,40 @@ interrupt:
     uaio_task_killall();
     goto loop;
 }
+
+
+/* A single iteration of the loop for embedding uaio into another event
+ * loop, it never idles, the caller does. Blocks in select(2) no longer
+ * than timeout_us, and only if no task is runnable. Then steps the
+ * runnable tasks once and reports the time the caller may block for in
+ * next_us, zero if there are runnable tasks, UAIO_IDLE_FOREVER if no
+ * timer is armed. Returns the number of remaining tasks. */
+int
+uaio_run_once(unsigned long timeout_us, unsigned long *next_us) {
+    struct uaio_task *task;
+    struct uaio_taskpool *taskpool = &_uaio->taskpool;
+
+    if (uaio_taskpool_next(taskpool, NULL, UAIO_RUNNING | UAIO_TERMINATING)) {
+        timeout_us = 0;
+    }
+
+    if (_poll(timeout_us)) {
+        uaio_task_killall();
+    }
+
+    task = uaio_taskpool_next(taskpool, NULL, UAIO_RUNNING | UAIO_TERMINATING);
+    if (task) {
+        _dispatch(task);
+    }
+
+    if (next_us) {
+        *next_us = 0;
+        if (uaio_taskpool_next(taskpool, NULL,
+                    UAIO_RUNNING | UAIO_TERMINATING) == NULL) {
+            *next_us = uaio_timers_next(&_uaio->timers, uaio_now(),
+                    UAIO_IDLE_FOREVER);
+        }
+    }
+
+    return taskpool->count;
+}
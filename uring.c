@@ -0,0 +1,659 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "uaio.h"
+#include "uring.h"
+
+
+#define URING_IDLE 0
+#define URING_SUBMITTED 1
+#define URING_DONE 2
+#define URING_POLLING 3
+#define URING_POLLED 4
+
+
+#define URING_MUSTPOLL(e) (UAIO_MUSTWAIT(e) || ((e) == EALREADY))
+
+
+/* The bounce buffer of an accept */
+struct _acceptbuf {
+    socklen_t len;
+    struct sockaddr_storage addr;
+};
+
+
+static struct {
+    int fd;
+    bool available;
+
+    /* submission queue */
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned sqmask;
+    unsigned sqentries;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned tosubmit;
+
+    /* completion queue */
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+
+    char *sqring;
+    size_t sqringsize;
+    char *cqring;
+    size_t cqringsize;
+    size_t sqessize;
+
+    struct uaio_uringop ops[CONFIG_UAIO_URING_ENTRIES];
+    struct uaio_uringop *free;
+    size_t inflight;
+} _ring;
+
+
+static int
+_enter(unsigned tosubmit, unsigned mincomplete, unsigned flags) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, _ring.fd, tosubmit, mincomplete,
+                flags, NULL, 0);
+    } while ((ret == -1) && (errno == EINTR));
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    _ring.tosubmit -= ret;
+    return 0;
+}
+
+
+static struct io_uring_sqe *
+_sqe_get() {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *_ring.sqtail;
+    unsigned head = __atomic_load_n(_ring.sqhead, __ATOMIC_ACQUIRE);
+    unsigned index;
+
+    if ((tail - head) >= _ring.sqentries) {
+        /* Submission queue is full, flush it */
+        if (_enter(_ring.tosubmit, 0, 0)) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(_ring.sqhead, __ATOMIC_ACQUIRE);
+        if ((tail - head) >= _ring.sqentries) {
+            return NULL;
+        }
+    }
+
+    index = tail & _ring.sqmask;
+    sqe = &_ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    _ring.sqarray[index] = index;
+    return sqe;
+}
+
+
+static void
+_sqe_commit() {
+    __atomic_store_n(_ring.sqtail, *_ring.sqtail + 1, __ATOMIC_RELEASE);
+    _ring.tosubmit++;
+}
+
+
+/* Redirects the reads to a buffer owned by the op */
+static int
+_bounce(struct uaio_uringop *op, int opcode, void **addr, unsigned len,
+        uint64_t *off) {
+    struct _acceptbuf *a;
+
+    op->bounce = NULL;
+    op->dest = NULL;
+    op->addrlen = NULL;
+    switch (opcode) {
+        case IORING_OP_READ:
+        case IORING_OP_RECV:
+            if (len == 0) {
+                return 0;
+            }
+
+            op->bounce = uaio_malloc(UAIO_MEM_BUFFER, len);
+            if (op->bounce == NULL) {
+                return -1;
+            }
+            op->dest = *addr;
+            *addr = op->bounce;
+            return 0;
+
+        case IORING_OP_ACCEPT:
+            if ((*addr == NULL) || (*off == 0)) {
+                return 0;
+            }
+
+            a = uaio_malloc(UAIO_MEM_BUFFER, sizeof(struct _acceptbuf));
+            if (a == NULL) {
+                return -1;
+            }
+            op->bounce = a;
+            op->dest = *addr;
+            op->addrlen = (socklen_t *)(uintptr_t)*off;
+            a->len = sizeof(a->addr);
+            if (*op->addrlen < a->len) {
+                a->len = *op->addrlen;
+            }
+            *addr = &a->addr;
+            *off = (uintptr_t)&a->len;
+            return 0;
+    }
+
+    return 0;
+}
+
+
+/* Copies the result out to the task, if it's still there */
+static void
+_unbounce(struct uaio_uringop *op, int res) {
+    struct _acceptbuf *a = op->bounce;
+    socklen_t len;
+
+    if (op->bounce == NULL) {
+        return;
+    }
+
+    if (op->task && (res > 0) && (op->addrlen == NULL)) {
+        memcpy(op->dest, op->bounce, res);
+    }
+    else if (op->task && (res >= 0) && op->addrlen) {
+        len = a->len;
+        if (len > *op->addrlen) {
+            len = *op->addrlen;
+        }
+        memcpy(op->dest, &a->addr, len);
+        *op->addrlen = a->len;
+    }
+
+    uaio_free(UAIO_MEM_BUFFER, op->bounce);
+    op->bounce = NULL;
+}
+
+
+static int
+_reap() {
+    struct io_uring_cqe *cqe;
+    struct uaio_uringop *op;
+    struct uaio_task *task;
+    unsigned head = *_ring.cqhead;
+    unsigned tail = __atomic_load_n(_ring.cqtail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    while (head != tail) {
+        cqe = &_ring.cqes[head & _ring.cqmask];
+        head++;
+
+        /* timeouts and cancellations */
+        op = (struct uaio_uringop *)(uintptr_t)cqe->user_data;
+        if (op == NULL) {
+            continue;
+        }
+
+        _unbounce(op, cqe->res);
+        task = op->task;
+        if (task) {
+            task->waitreason = UAIO_WAIT_NONE;
+            task->uring = NULL;
+            task->uringresult = cqe->res;
+            task->uringstate = (task->uringstate == URING_POLLING)?
+                URING_POLLED: URING_DONE;
+            if (task->status == UAIO_WAITING) {
+                task->status = UAIO_RUNNING;
+            }
+        }
+
+        op->next = _ring.free;
+        _ring.free = op;
+        _ring.inflight--;
+        count++;
+    }
+
+    __atomic_store_n(_ring.cqhead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+
+/* Queues the operation, the submission is deferred to the next tick so
+ * all the tasks stepped in one loop iteration are submitted together. */
+static ssize_t
+_prep(struct uaio_task *task, int state, int opcode, int fd, void *addr,
+        unsigned len, uint64_t off, uint32_t flags) {
+    struct io_uring_sqe *sqe;
+    struct uaio_uringop *op = _ring.free;
+
+    if (op == NULL) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    sqe = _sqe_get();
+    if (sqe == NULL) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (_bounce(op, opcode, &addr, len, &off)) {
+        return -1;
+    }
+
+    _ring.free = op->next;
+    _ring.inflight++;
+    op->task = task;
+    op->next = NULL;
+    task->waitreason = UAIO_WAIT_URING;
+    task->uring = op;
+    task->uringstate = state;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->msg_flags = flags;
+    sqe->user_data = (uintptr_t)op;
+    _sqe_commit();
+
+    errno = EINPROGRESS;
+    return -1;
+}
+
+
+static uint32_t
+_pollmask(int events) {
+    uint32_t mask = 0;
+
+    if (events & UAIO_IN) {
+        mask |= POLLIN;
+    }
+
+    if (events & UAIO_OUT) {
+        mask |= POLLOUT;
+    }
+
+    if (events & UAIO_ERR) {
+        mask |= POLLERR;
+    }
+
+    return mask;
+}
+
+
+static ssize_t
+_await(struct uaio_task *task, int opcode, int fd, void *addr,
+        unsigned len, uint64_t off, uint32_t flags, int events) {
+    int res;
+
+    switch (task->uringstate) {
+        case URING_SUBMITTED:
+        case URING_POLLING:
+            errno = EINPROGRESS;
+            return -1;
+
+        case URING_DONE:
+            task->uringstate = URING_IDLE;
+            res = task->uringresult;
+            if (res >= 0) {
+                return res;
+            }
+
+            if (!URING_MUSTPOLL(-res)) {
+                errno = -res;
+                return -1;
+            }
+
+            /* Non-blocking file is not ready, retry when it is */
+            return _prep(task, URING_POLLING, IORING_OP_POLL_ADD, fd, NULL,
+                    0, 0, _pollmask(events));
+
+        case URING_POLLED:
+            task->uringstate = URING_IDLE;
+            if (task->uringresult < 0) {
+                errno = -task->uringresult;
+                return -1;
+            }
+            break;
+    }
+
+    return _prep(task, URING_SUBMITTED, opcode, fd, addr, len, off, flags);
+}
+
+
+static ssize_t
+_fallback(struct uaio_task *task, ssize_t ret, int fd, int events) {
+    if (ret >= 0) {
+        return ret;
+    }
+
+    if (!URING_MUSTPOLL(errno)) {
+        return -1;
+    }
+
+    if (uaio_file_monitor(task, fd, events, 0)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+
+ssize_t
+uaio_uring_read(struct uaio_task *task, int fd, void *buf, size_t size) {
+    if (!_ring.available) {
+        return _fallback(task, read(fd, buf, size), fd, UAIO_IN);
+    }
+
+    return _await(task, IORING_OP_READ, fd, buf, size, (uint64_t)-1, 0,
+            UAIO_IN);
+}
+
+
+ssize_t
+uaio_uring_write(struct uaio_task *task, int fd, const void *buf,
+        size_t size) {
+    if (!_ring.available) {
+        return _fallback(task, write(fd, buf, size), fd, UAIO_OUT);
+    }
+
+    return _await(task, IORING_OP_WRITE, fd, (void *)buf, size,
+            (uint64_t)-1, 0, UAIO_OUT);
+}
+
+
+ssize_t
+uaio_uring_recv(struct uaio_task *task, int fd, void *buf, size_t size,
+        int flags) {
+    if (!_ring.available) {
+        return _fallback(task, recv(fd, buf, size, flags), fd, UAIO_IN);
+    }
+
+    return _await(task, IORING_OP_RECV, fd, buf, size, 0, flags, UAIO_IN);
+}
+
+
+ssize_t
+uaio_uring_send(struct uaio_task *task, int fd, const void *buf,
+        size_t size, int flags) {
+    if (!_ring.available) {
+        return _fallback(task, send(fd, buf, size, flags), fd, UAIO_OUT);
+    }
+
+    return _await(task, IORING_OP_SEND, fd, (void *)buf, size, 0, flags,
+            UAIO_OUT);
+}
+
+
+int
+uaio_uring_accept(struct uaio_task *task, int fd, struct sockaddr *addr,
+        socklen_t *addrlen) {
+    if (!_ring.available) {
+        return _fallback(task, accept(fd, addr, addrlen), fd, UAIO_IN);
+    }
+
+    return _await(task, IORING_OP_ACCEPT, fd, addr, 0,
+            (uintptr_t)addrlen, 0, UAIO_IN);
+}
+
+
+int
+uaio_uring_connect(struct uaio_task *task, int fd,
+        const struct sockaddr *addr, socklen_t addrlen) {
+    int ret;
+
+    if (!_ring.available) {
+        ret = _fallback(task, connect(fd, addr, addrlen), fd, UAIO_OUT);
+    }
+    else {
+        ret = _await(task, IORING_OP_CONNECT, fd, (void *)addr, 0, addrlen,
+                0, UAIO_OUT);
+    }
+
+    /* A retried non-blocking connect reports the established connection
+     * this way */
+    if ((ret == -1) && (errno == EISCONN)) {
+        errno = 0;
+        return 0;
+    }
+
+    return ret;
+}
+
+
+int
+uaio_uring_init() {
+    struct io_uring_params p;
+    int fd;
+    int i;
+
+    memset(&_ring, 0, sizeof(_ring));
+    _ring.fd = -1;
+    for (i = 0; i < CONFIG_UAIO_URING_ENTRIES; i++) {
+        _ring.ops[i].next = _ring.free;
+        _ring.free = &_ring.ops[i];
+    }
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, CONFIG_UAIO_URING_ENTRIES, &p);
+    if (fd < 0) {
+        /* Not supported or not permitted, stick to select(2) */
+        errno = 0;
+        return 0;
+    }
+    _ring.fd = fd;
+
+    _ring.sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _ring.cqringsize = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (_ring.cqringsize > _ring.sqringsize) {
+            _ring.sqringsize = _ring.cqringsize;
+        }
+        _ring.cqringsize = _ring.sqringsize;
+    }
+
+    _ring.sqring = mmap(NULL, _ring.sqringsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (_ring.sqring == (char *)MAP_FAILED) {
+        _ring.sqring = NULL;
+        goto failure;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        _ring.cqring = _ring.sqring;
+    }
+    else {
+        _ring.cqring = mmap(NULL, _ring.cqringsize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (_ring.cqring == (char *)MAP_FAILED) {
+            _ring.cqring = NULL;
+            goto failure;
+        }
+    }
+
+    _ring.sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    _ring.sqes = mmap(NULL, _ring.sqessize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (_ring.sqes == MAP_FAILED) {
+        _ring.sqes = NULL;
+        goto failure;
+    }
+
+    _ring.sqhead = (unsigned *)(_ring.sqring + p.sq_off.head);
+    _ring.sqtail = (unsigned *)(_ring.sqring + p.sq_off.tail);
+    _ring.sqmask = *(unsigned *)(_ring.sqring + p.sq_off.ring_mask);
+    _ring.sqentries = *(unsigned *)(_ring.sqring + p.sq_off.ring_entries);
+    _ring.sqarray = (unsigned *)(_ring.sqring + p.sq_off.array);
+    _ring.cqhead = (unsigned *)(_ring.cqring + p.cq_off.head);
+    _ring.cqtail = (unsigned *)(_ring.cqring + p.cq_off.tail);
+    _ring.cqmask = *(unsigned *)(_ring.cqring + p.cq_off.ring_mask);
+    _ring.cqes = (struct io_uring_cqe *)(_ring.cqring + p.cq_off.cqes);
+    _ring.available = true;
+    return 0;
+
+failure:
+    uaio_uring_deinit();
+    errno = 0;
+    return 0;
+}
+
+
+int
+uaio_uring_deinit() {
+    int i;
+
+    if (_ring.sqes) {
+        munmap(_ring.sqes, _ring.sqessize);
+        _ring.sqes = NULL;
+    }
+
+    if (_ring.cqring && (_ring.cqring != _ring.sqring)) {
+        munmap(_ring.cqring, _ring.cqringsize);
+    }
+    _ring.cqring = NULL;
+
+    if (_ring.sqring) {
+        munmap(_ring.sqring, _ring.sqringsize);
+        _ring.sqring = NULL;
+    }
+
+    if (_ring.fd >= 0) {
+        close(_ring.fd);
+        _ring.fd = -1;
+    }
+
+    /* bounce buffers of the operations never completed */
+    for (i = 0; i < CONFIG_UAIO_URING_ENTRIES; i++) {
+        uaio_free(UAIO_MEM_BUFFER, _ring.ops[i].bounce);
+        _ring.ops[i].bounce = NULL;
+    }
+
+    _ring.available = false;
+    return 0;
+}
+
+
+bool
+uaio_uring_available() {
+    return _ring.available;
+}
+
+
+/* Submits everything queued by the previous loop iteration and resumes
+ * the tasks whose operations are completed. */
+int
+uaio_uring_tick() {
+    if (!_ring.available) {
+        return 0;
+    }
+
+    if (_ring.tosubmit && _enter(_ring.tosubmit, 0, 0)) {
+        return -1;
+    }
+
+    return _reap();
+}
+
+
+/* Blocks until the first completion or the timeout, used by the loop
+ * instead of sleeping when it's idle. Returns -1 if there is nothing to
+ * wait for. */
+int
+uaio_uring_wait(unsigned long timeout_us) {
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+
+    if ((!_ring.available) || (_ring.inflight == 0)) {
+        return -1;
+    }
+
+    sqe = _sqe_get();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ts;
+    sqe->len = 1;
+
+    /* completes after the first other completion as well */
+    sqe->off = 1;
+    sqe->user_data = 0;
+    _sqe_commit();
+
+    if (_enter(_ring.tosubmit, 1, IORING_ENTER_GETEVENTS)) {
+        return -1;
+    }
+
+    _reap();
+    return 0;
+}
+
+
+/* The task is going away, the completion must not touch it anymore. A
+ * pending read is left to the bounce buffer of the op, but writes still
+ * read from the task's buffer until the cancellation is done. */
+void
+uaio_uring_orphan(struct uaio_task *task) {
+    struct io_uring_sqe *sqe;
+    struct uaio_uringop *op;
+
+    if (task->waitreason != UAIO_WAIT_URING) {
+        return;
+    }
+
+    op = task->uring;
+    op->task = NULL;
+    task->waitreason = UAIO_WAIT_NONE;
+    task->uring = NULL;
+    task->uringstate = URING_IDLE;
+
+    sqe = _sqe_get();
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)op;
+    sqe->user_data = 0;
+    _sqe_commit();
+}
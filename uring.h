@@ -0,0 +1,59 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifndef URING_H_
+#define URING_H_
+
+
+#include "uaio.h"
+
+
+struct uaio_uringop {
+    /* NULL when the task is disposed before the completion */
+    struct uaio_task *task;
+    struct uaio_uringop *next;
+
+    /* reads land in the op's own buffer and are copied out to dest on
+     * completion, so an orphaned read never writes into the task's memory */
+    void *bounce;
+    void *dest;
+    socklen_t *addrlen;
+};
+
+
+int
+uaio_uring_init();
+
+
+int
+uaio_uring_deinit();
+
+
+int
+uaio_uring_tick();
+
+
+int
+uaio_uring_wait(unsigned long timeout_us);
+
+
+void
+uaio_uring_orphan(struct uaio_task *task);
+
+
+#endif  // URING_H_
@@ -0,0 +1,103 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <stddef.h>
+
+#include "waitqueue.h"
+
+
+/* Intrusive FIFO of the waiting tasks, a task may wait on one queue at a
+ * time */
+void
+uaio_waitqueue_push(struct uaio_waitqueue *q, struct uaio_task *task) {
+    task->waitreason = UAIO_WAIT_QUEUE;
+    task->waitqueue = q;
+    task->waitnext = NULL;
+    task->waitprev = q->tail;
+
+    if (q->tail) {
+        q->tail->waitnext = task;
+    }
+    else {
+        q->head = task;
+    }
+    q->tail = task;
+    q->count++;
+}
+
+
+/* Returns -1 if the task is not in any queue */
+int
+uaio_waitqueue_remove(struct uaio_task *task) {
+    struct uaio_waitqueue *q;
+
+    if (task->waitreason != UAIO_WAIT_QUEUE) {
+        return -1;
+    }
+    q = task->waitqueue;
+
+    if (task->waitprev) {
+        task->waitprev->waitnext = task->waitnext;
+    }
+    else {
+        q->head = task->waitnext;
+    }
+
+    if (task->waitnext) {
+        task->waitnext->waitprev = task->waitprev;
+    }
+    else {
+        q->tail = task->waitprev;
+    }
+
+    task->waitreason = UAIO_WAIT_NONE;
+    task->waitqueue = NULL;
+    task->waitnext = NULL;
+    task->waitprev = NULL;
+    q->count--;
+    return 0;
+}
+
+
+struct uaio_task *
+uaio_waitqueue_pop(struct uaio_waitqueue *q) {
+    struct uaio_task *task = q->head;
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    uaio_waitqueue_remove(task);
+    return task;
+}
+
+
+/* Wakes up the first waiter, if any */
+int
+uaio_waitqueue_wakeup(struct uaio_waitqueue *q) {
+    struct uaio_task *task = uaio_waitqueue_pop(q);
+
+    if (task == NULL) {
+        return -1;
+    }
+
+    if (task->status == UAIO_WAITING) {
+        task->status = UAIO_RUNNING;
+    }
+    return 0;
+}
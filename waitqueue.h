@@ -0,0 +1,42 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#ifndef WAITQUEUE_H_
+#define WAITQUEUE_H_
+
+
+#include "uaio.h"
+
+
+void
+uaio_waitqueue_push(struct uaio_waitqueue *q, struct uaio_task *task);
+
+
+struct uaio_task *
+uaio_waitqueue_pop(struct uaio_waitqueue *q);
+
+
+int
+uaio_waitqueue_remove(struct uaio_task *task);
+
+
+int
+uaio_waitqueue_wakeup(struct uaio_waitqueue *q);
+
+
+#endif  // WAITQUEUE_H_
@@ -0,0 +1,193 @@
+// Copyright 2023 Vahid Mardani
+/*
+ * This file is part of uaio.
+ *  uaio is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  uaio is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with uaio. If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Author: Vahid Mardani <vahid.mardani@gmail.com>
+ */
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "uaio.h"
+
+
+#define ENTRY_ISDONE(e) ((e)->done == (e)->size)
+
+
+static void
+_wakeup(struct uaio_task *task) {
+    if (task && (task->status == UAIO_WAITING)) {
+        task->status = UAIO_RUNNING;
+    }
+}
+
+
+static void
+_pop(struct uaio_wqueue *q) {
+    q->head = q->head->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+}
+
+
+int
+uaio_wqueue_init(struct uaio_wqueue *q, int fd) {
+    if ((q == NULL) || (fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    q->fd = fd;
+    q->head = NULL;
+    q->tail = NULL;
+    return 0;
+}
+
+
+void
+uaio_wqueue_push(struct uaio_wqueue *q, struct uaio_wqentry *e,
+        struct uaio_task *task, const char *buf, size_t size) {
+    e->buf = buf;
+    e->size = size;
+    e->done = 0;
+    e->task = task;
+    e->next = NULL;
+
+    if (q->tail) {
+        q->tail->next = e;
+    }
+    else {
+        q->head = e;
+    }
+    q->tail = e;
+}
+
+
+/* Only the head entry's task waits for the file, others wait until the
+ * head writes their data or leaves the queue. */
+int
+uaio_wqueue_park(struct uaio_task *task, struct uaio_wqueue *q,
+        struct uaio_wqentry *e) {
+    if (q->head != e) {
+        return 0;
+    }
+
+    return uaio_file_monitor(task, q->fd, UAIO_OUT, 0);
+}
+
+
+int
+uaio_wqueue_cancel(struct uaio_wqueue *q, struct uaio_wqentry *e) {
+    struct uaio_wqentry *prev = NULL;
+    struct uaio_wqentry *cur = q->head;
+
+    while (cur && (cur != e)) {
+        prev = cur;
+        cur = cur->next;
+    }
+
+    if (cur == NULL) {
+        return -1;
+    }
+
+    if (prev) {
+        prev->next = e->next;
+        if (q->tail == e) {
+            q->tail = prev;
+        }
+        return 0;
+    }
+
+    _pop(q);
+    if (q->head) {
+        _wakeup(q->head->task);
+    }
+    return 0;
+}
+
+
+/* Writes all the pending entries with a single writev(2) on behalf of
+ * their tasks and wakes up the tasks whose data is completely written. */
+int
+uaio_wqueue_flush(struct uaio_wqueue *q, struct uaio_wqentry *e) {
+    struct iovec iov[CONFIG_UAIO_WQUEUE_IOVMAX];
+    struct uaio_wqentry *cur;
+    ssize_t bytes;
+    size_t chunk;
+    int count = 0;
+
+    if (ENTRY_ISDONE(e)) {
+        /* An empty entry has nothing to write but its turn */
+        if (q->head == e) {
+            _pop(q);
+            if (q->head) {
+                _wakeup(q->head->task);
+            }
+        }
+        return 0;
+    }
+
+    if (q->head != e) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (cur = e; cur && (count < CONFIG_UAIO_WQUEUE_IOVMAX);
+            cur = cur->next) {
+        iov[count].iov_base = (void *)(cur->buf + cur->done);
+        iov[count].iov_len = cur->size - cur->done;
+        count++;
+    }
+
+    bytes = writev(q->fd, iov, count);
+    if (bytes < 0) {
+        if (!UAIO_MUSTWAIT(errno)) {
+            /* Let the next one find out the error by itself */
+            uaio_wqueue_cancel(q, e);
+        }
+        return -1;
+    }
+
+    /* Empty entries are popped even if nothing is left of the bytes */
+    while ((cur = q->head)) {
+        chunk = cur->size - cur->done;
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        cur->done += chunk;
+        bytes -= chunk;
+
+        if (!ENTRY_ISDONE(cur)) {
+            break;
+        }
+
+        _pop(q);
+        if (cur != e) {
+            _wakeup(cur->task);
+        }
+    }
+
+    if (!ENTRY_ISDONE(e)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* Hand over the file to the next writer */
+    if (q->head) {
+        _wakeup(q->head->task);
+    }
+    return 0;
+}